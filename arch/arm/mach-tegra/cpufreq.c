@@ -36,6 +36,7 @@
 #include <linux/suspend.h>
 #include <linux/reboot.h>
 #include <linux/delay.h>
+#include <linux/tick.h>
 
 #include <asm/system.h>
 #include <asm/smp_twd.h>
@@ -47,6 +48,9 @@
 #include <nvrm_power.h>
 #include <nvrm_power_private.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/tegra_hotplug.h>
+
 #define KTHREAD_IRQ_PRIO (MAX_RT_PRIO>>1)
 
 static NvRmDeviceHandle rm_cpufreq = NULL;
@@ -58,6 +62,38 @@ static DEFINE_MUTEX(init_mutex);
 #ifdef CONFIG_HOTPLUG_CPU
 static int disable_hotplug = 0;
 extern atomic_t hotplug_policy;
+
+/*
+ * In-kernel hotplug policy.  While enabled, the NvRm CpuOn/CpuOff requests
+ * are ignored and a secondary core is brought up when the run queues stay
+ * deep and busy, and taken down again when they stay shallow and idle.
+ */
+static int hotplug_governor = 1;
+module_param(hotplug_governor, int, 0644);
+static unsigned int hotplug_sample_ms = 50;
+module_param(hotplug_sample_ms, uint, 0644);
+/* Average runnable tasks per online CPU, in hundredths */
+static unsigned int hotplug_up_nr = 150;
+module_param(hotplug_up_nr, uint, 0644);
+static unsigned int hotplug_down_nr = 80;
+module_param(hotplug_down_nr, uint, 0644);
+/* Average utilization of the online CPUs, in percent */
+static unsigned int hotplug_up_load = 70;
+module_param(hotplug_up_load, uint, 0644);
+static unsigned int hotplug_down_load = 30;
+module_param(hotplug_down_load, uint, 0644);
+/* Consecutive samples that must agree before a CPU is added or removed */
+static unsigned int hotplug_up_samples = 2;
+module_param(hotplug_up_samples, uint, 0644);
+static unsigned int hotplug_down_samples = 10;
+module_param(hotplug_down_samples, uint, 0644);
+
+static unsigned int hotplug_avg_nr;
+static unsigned int hotplug_up_count;
+static unsigned int hotplug_down_count;
+static DEFINE_PER_CPU(u64, hotplug_prev_idle);
+static DEFINE_PER_CPU(u64, hotplug_prev_wall);
+static struct delayed_work hotplug_work;
 #endif
 
 /* Frequency table index must be sequential starting at 0 and
@@ -102,7 +138,7 @@ static void tegra_cpufreq_hotplug(NvRmPmRequest req)
 	int policy = atomic_read(&hotplug_policy);
 
 	smp_rmb();
-	if (disable_hotplug)
+	if (disable_hotplug || hotplug_governor)
 		return;
 
 
@@ -128,6 +164,84 @@ static void tegra_cpufreq_hotplug(NvRmPmRequest req)
 }
 
 #ifdef CONFIG_HOTPLUG_CPU
+static unsigned int tegra_hotplug_load(void)
+{
+	unsigned int cpu;
+	unsigned int load = 0;
+	u64 idle, wall, d_idle, d_wall;
+
+	for_each_online_cpu(cpu) {
+		idle = get_cpu_idle_time_us(cpu, &wall);
+		if (idle == -1ULL)
+			return 100;
+
+		d_idle = idle - per_cpu(hotplug_prev_idle, cpu);
+		d_wall = wall - per_cpu(hotplug_prev_wall, cpu);
+		per_cpu(hotplug_prev_idle, cpu) = idle;
+		per_cpu(hotplug_prev_wall, cpu) = wall;
+
+		if (d_wall && d_idle < d_wall)
+			load += div64_u64(100 * (d_wall - d_idle), d_wall);
+	}
+
+	return load / num_online_cpus();
+}
+
+static void tegra_hotplug_work(struct work_struct *work)
+{
+	unsigned int online = num_online_cpus();
+	unsigned int nr, load, cpu;
+	int policy = atomic_read(&hotplug_policy);
+	int rc;
+
+	/* Do not count the worker itself. */
+	nr = nr_running();
+	nr = nr > 1 ? (nr - 1) * 100 : 0;
+	hotplug_avg_nr = (hotplug_avg_nr * 3 + nr) / 4;
+	load = tegra_hotplug_load();
+	trace_tegra_hotplug_sample(online, hotplug_avg_nr, load);
+
+	smp_rmb();
+	if (!hotplug_governor || disable_hotplug || policy)
+		goto out;
+
+	if (online < num_present_cpus() &&
+	    hotplug_avg_nr / online >= hotplug_up_nr &&
+	    load >= hotplug_up_load) {
+		hotplug_down_count = 0;
+		if (++hotplug_up_count < hotplug_up_samples)
+			goto out;
+		hotplug_up_count = 0;
+
+		cpu = cpumask_next_zero(0, cpu_online_mask);
+		if (cpu >= nr_cpu_ids || !cpu_present(cpu))
+			goto out;
+		rc = cpu_up(cpu);
+		trace_tegra_hotplug_decision(cpu, true, rc);
+	} else if (online > 1 &&
+		   hotplug_avg_nr / online < hotplug_down_nr &&
+		   load < hotplug_down_load) {
+		hotplug_up_count = 0;
+		if (++hotplug_down_count < hotplug_down_samples)
+			goto out;
+		hotplug_down_count = 0;
+
+		cpu = cpumask_any_but(cpu_online_mask, 0);
+		if (cpu >= nr_cpu_ids)
+			goto out;
+		rc = cpu_down(cpu);
+		trace_tegra_hotplug_decision(cpu, false, rc);
+	} else {
+		hotplug_up_count = 0;
+		hotplug_down_count = 0;
+	}
+
+out:
+	/* Always sample from CPU 0, which is never taken down. */
+	queue_delayed_work_on(0, system_freezable_wq, &hotplug_work,
+			      msecs_to_jiffies(hotplug_sample_ms));
+}
+
 static int tegra_cpufreq_pm_notifier(struct notifier_block *nfb,
 				     unsigned long event, void *data)
 {
@@ -370,12 +484,18 @@ static int __init tegra_cpufreq_init(void)
 {
 #ifdef CONFIG_HOTPLUG_CPU
 	pm_notifier(tegra_cpufreq_pm_notifier, 0);
+	INIT_DELAYED_WORK_DEFERRABLE(&hotplug_work, tegra_hotplug_work);
+	queue_delayed_work_on(0, system_freezable_wq, &hotplug_work,
+			      msecs_to_jiffies(hotplug_sample_ms));
 #endif
 	return cpufreq_register_driver(&s_tegra_cpufreq_driver);
 }
 
 static void __exit tegra_cpufreq_exit(void)
 {
+#ifdef CONFIG_HOTPLUG_CPU
+	cancel_delayed_work_sync(&hotplug_work);
+#endif
 	kthread_stop(cpufreq_dfsd);
 	clk_put(clk_cpu);
 	unregister_reboot_notifier(&dfs_reboot_nb);
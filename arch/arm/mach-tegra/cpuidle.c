@@ -27,7 +27,10 @@
 #include <linux/cpuidle.h>
 #include <linux/hrtimer.h>
 #include <linux/cpu.h>
+#include <linux/debugfs.h>
 #include <linux/io.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
 #include <linux/tick.h>
 #include <linux/interrupt.h>
 #include <linux/slab.h>
@@ -42,6 +45,26 @@ static unsigned int latency_factor __read_mostly = 80;	// factor ~ 0.3
 static unsigned int pwrgood_latency = 2000;
 static unsigned int system_is_suspending = 0;
 module_param(latency_factor, uint, 0644);
+static unsigned int predict_residency __read_mostly = 1;
+module_param(predict_residency, uint, 0644);
+
+/*
+ * Recent idle durations of each CPU, used to predict whether the next
+ * idle period will be long enough to pay back LP2 entry and exit, and
+ * statistics on how good those predictions turned out to be.
+ */
+#define IDLE_HISTORY 8
+
+struct tegra_idle_stats {
+	unsigned int history[IDLE_HISTORY];
+	unsigned int next;
+	unsigned int lp2_count;		/* LP2 entered */
+	unsigned int lp2_miss;		/* ... but woke before break-even */
+	unsigned int lp2_declined;	/* LP2 possible, LP3 predicted */
+	unsigned int lp2_declined_miss;	/* ... but LP2 would have paid off */
+};
+
+static DEFINE_PER_CPU(struct tegra_idle_stats, idle_stats);
 
 struct cpuidle_driver tegra_idle = {
 	.name = "tegra_idle",
@@ -65,6 +88,55 @@ void __init tegra_init_idle(struct tegra_suspend_platform_data *plat)
 	pwrgood_latency = plat->cpu_timer;
 }
 
+static void tegra_idle_record(unsigned int cpu, s64 us)
+{
+	struct tegra_idle_stats *st = &per_cpu(idle_stats, cpu);
+
+	st->history[st->next] = clamp_t(s64, us, 1, UINT_MAX);
+	st->next = (st->next + 1) % IDLE_HISTORY;
+}
+
+/*
+ * Predict the next idle duration from the history: drop the longest
+ * samples until the rest are consistent (standard deviation below a
+ * sixth of the mean) and use their mean.  Returns UINT_MAX when there is
+ * not enough consistent history, leaving the decision to the next timer.
+ */
+static unsigned int tegra_idle_predict(struct tegra_idle_stats *st)
+{
+	unsigned int thresh = UINT_MAX;
+	unsigned int i, n, max, v;
+	u64 sum, sq, avg, var;
+
+	do {
+		sum = 0;
+		sq = 0;
+		n = 0;
+		max = 0;
+		for (i = 0; i < IDLE_HISTORY; i++) {
+			v = st->history[i];
+			if (!v || v > thresh)
+				continue;
+			sum += v;
+			sq += (u64)v * v;
+			n++;
+			if (v > max)
+				max = v;
+		}
+		if (n < IDLE_HISTORY / 2)
+			break;
+
+		avg = div_u64(sum, n);
+		var = div_u64(sq, n) - avg * avg;
+		if (avg * avg > 36 * var)
+			return (unsigned int)avg;
+
+		thresh = max - 1;
+	} while (n > (IDLE_HISTORY * 3) / 4);
+
+	return UINT_MAX;
+}
+
 static int tegra_idle_enter_lp3(struct cpuidle_device *dev,
 	struct cpuidle_state *state)
 {
@@ -91,6 +163,7 @@ static int tegra_idle_enter_lp3(struct cpuidle_device *dev,
 	enter = ktime_sub(exit, enter);
 	us = ktime_to_us(enter);
 	local_irq_enable();
+	tegra_idle_record(dev->cpu, us);
 	return (int)us;
 }
 
@@ -101,20 +174,31 @@ static int tegra_idle_enter_lp2(struct cpuidle_device *dev,
 	struct cpuidle_state *state)
 {
 	ktime_t enter;
-	s64 request, us, latency, idle_us;
+	s64 request, us, latency, idle_us, breakeven;
 	struct tick_sched *ts = tick_get_tick_sched(dev->cpu);
+	struct tegra_idle_stats *st = &per_cpu(idle_stats, dev->cpu);
 	unsigned int last_sample = (unsigned int)cpuidle_get_statedata(state);
 
 	/* LP2 not possible when running in SMP mode */
 	smp_rmb();
-	idle_us = state->exit_latency + state->target_residency;
+	breakeven = state->exit_latency + state->target_residency;
 	request = ktime_to_us(tick_nohz_get_sleep_length());
-	if (!lp2_supported || request <= idle_us || (!ts->tick_stopped) ||
+	if (!lp2_supported || request <= breakeven || (!ts->tick_stopped) ||
 		system_is_suspending || (!tegra_nvrm_lp2_allowed())) {
 		dev->last_state = &dev->states[0];
 		return tegra_idle_enter_lp3(dev, &dev->states[0]);
 	}
 
+	/* The next timer is far enough, but interrupts may come sooner. */
+	if (predict_residency && tegra_idle_predict(st) <= breakeven) {
+		dev->last_state = &dev->states[0];
+		us = tegra_idle_enter_lp3(dev, &dev->states[0]);
+		st->lp2_declined++;
+		if (us > breakeven)
+			st->lp2_declined_miss++;
+		return (int)us;
+	}
+
 	local_irq_disable();
 	enter = ktime_get();
 	request -= state->exit_latency;
@@ -131,6 +215,12 @@ static int tegra_idle_enter_lp2(struct cpuidle_device *dev,
 	hrtimer_peek_ahead_timers();
 
 	local_irq_enable();
+
+	st->lp2_count++;
+	if (idle_us < breakeven)
+		st->lp2_miss++;
+	tegra_idle_record(dev->cpu, idle_us);
+
 	return (int)idle_us;
 }
 
@@ -223,6 +313,33 @@ static int tegra_idle_enter(unsigned int cpu)
 	return 0;
 }
 
+static int tegra_idle_stats_show(struct seq_file *s, void *data)
+{
+	struct tegra_idle_stats *st;
+	unsigned int cpu;
+
+	seq_printf(s, "cpu  predict    lp2  lp2_miss  declined  declined_miss\n");
+	for_each_possible_cpu(cpu) {
+		st = &per_cpu(idle_stats, cpu);
+		seq_printf(s, "%3u %8u %6u %9u %9u %14u\n", cpu,
+			   tegra_idle_predict(st), st->lp2_count, st->lp2_miss,
+			   st->lp2_declined, st->lp2_declined_miss);
+	}
+	return 0;
+}
+
+static int tegra_idle_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tegra_idle_stats_show, inode->i_private);
+}
+
+static const struct file_operations tegra_idle_stats_fops = {
+	.open		= tegra_idle_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int __init tegra_cpuidle_init(void)
 {
 	unsigned int cpu = smp_processor_id();
@@ -241,6 +358,9 @@ static int __init tegra_cpuidle_init(void)
 		if (tegra_idle_enter(cpu))
 			pr_err("CPU%u: error initializing idle loop\n", cpu);
 	}
+
+	debugfs_create_file("tegra_cpuidle", S_IRUGO, NULL, NULL,
+			    &tegra_idle_stats_fops);
 	return 0;
 }
 
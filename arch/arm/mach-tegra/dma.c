@@ -29,6 +29,7 @@
 #include <linux/err.h>
 #include <linux/irq.h>
 #include <linux/delay.h>
+#include <linux/scatterlist.h>
 #include <mach/dma.h>
 #include <mach/irqs.h>
 #include <mach/iomap.h>
@@ -115,6 +116,7 @@ const unsigned int bus_width_table[5] = {8, 16, 32, 64, 128};
 #define TEGRA_DMA_NAME_SIZE 16
 struct tegra_dma_channel {
 	struct list_head	list;
+	struct list_head	done;	/* finished, callback not yet run */
 	int			id;
 	spinlock_t		lock;
 	char			name[TEGRA_DMA_NAME_SIZE];
@@ -196,6 +198,8 @@ int tegra_dma_cancel(struct tegra_dma_channel *ch)
 	spin_lock_irqsave(&ch->lock, irq_flags);
 	while (!list_empty(&ch->list))
 		list_del(ch->list.next);
+	while (!list_empty(&ch->done))
+		list_del(ch->done.next);
 
 	tegra_dma_stop(ch);
 
@@ -406,6 +410,18 @@ int tegra_dma_dequeue_req(struct tegra_dma_channel *ch,
 		}
 	}
 	if (!found) {
+		/*
+		 * Finished, but the interrupt thread hasn't run its callback
+		 * yet: complete it here so that it can be queued again.
+		 */
+		list_for_each_entry(req, &ch->done, node) {
+			if (req == _req) {
+				list_del(&req->node);
+				spin_unlock_irqrestore(&ch->lock, irq_flags);
+				req->complete(req);
+				return 0;
+			}
+		}
 		spin_unlock_irqrestore(&ch->lock, irq_flags);
 		return 0;
 	}
@@ -443,7 +459,7 @@ bool tegra_dma_is_empty(struct tegra_dma_channel *ch)
 		BUG();
 
 	spin_lock_irqsave(&ch->lock, irq_flags);
-	if (list_empty(&ch->list))
+	if (list_empty(&ch->list) && list_empty(&ch->done))
 		is_empty = true;
 	else
 		is_empty = false;
@@ -452,24 +468,34 @@ bool tegra_dma_is_empty(struct tegra_dma_channel *ch)
 }
 EXPORT_SYMBOL(tegra_dma_is_empty);
 
+/* should be called with the channel lock held */
+static bool tegra_dma_req_queued(struct tegra_dma_channel *ch,
+	struct tegra_dma_req *_req)
+{
+	struct tegra_dma_req *req;
+
+	list_for_each_entry(req, &ch->list, node)
+		if (req == _req)
+			return true;
+	list_for_each_entry(req, &ch->done, node)
+		if (req == _req)
+			return true;
+	return false;
+}
+
 bool tegra_dma_is_req_inflight(struct tegra_dma_channel *ch,
 	struct tegra_dma_req *_req)
 {
 	unsigned long irq_flags;
-	struct tegra_dma_req *req;
+	bool inflight;
 
 	if (IS_ERR_OR_NULL(ch))
 		BUG();
 
 	spin_lock_irqsave(&ch->lock, irq_flags);
-	list_for_each_entry(req, &ch->list, node) {
-		if (req == _req) {
-			spin_unlock_irqrestore(&ch->lock, irq_flags);
-			return true;
-		}
-	}
+	inflight = tegra_dma_req_queued(ch, _req);
 	spin_unlock_irqrestore(&ch->lock, irq_flags);
-	return false;
+	return inflight;
 }
 EXPORT_SYMBOL(tegra_dma_is_req_inflight);
 
@@ -493,6 +519,13 @@ int tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
 
 	spin_lock_irqsave(&ch->lock, irq_flags);
 
+	/* still queued, or its callback hasn't run yet */
+	if (tegra_dma_req_queued(ch, req)) {
+		spin_unlock_irqrestore(&ch->lock, irq_flags);
+		pr_err("DMA request already queued on channel %d\n", ch->id);
+		return -EBUSY;
+	}
+
 	req->bytes_transferred = 0;
 	req->status = 0;
 	req->buffer_status = 0;
@@ -510,6 +543,86 @@ int tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
 }
 EXPORT_SYMBOL(tegra_dma_enqueue_req);
 
+/*
+ * Queue one request per entry of a DMA-mapped scatterlist in a single go.
+ * reqs[] is caller owned and holds nents requests; everything in reqs[0]
+ * except the memory side address and the size is used as the template for
+ * all of them. Only for one shot channels.
+ */
+int tegra_dma_enqueue_sg(struct tegra_dma_channel *ch,
+	struct tegra_dma_req *reqs, struct scatterlist *sgl, unsigned int nents)
+{
+	struct scatterlist *sg;
+	unsigned long irq_flags;
+	unsigned long dev_addr;
+	int start_dma = 0;
+	unsigned int i;
+
+	if (IS_ERR_OR_NULL(ch))
+		BUG();
+
+	if (!(ch->mode & TEGRA_DMA_MODE_ONESHOT) || !nents)
+		return -EINVAL;
+
+	dev_addr = reqs[0].to_memory ? reqs[0].source_addr : reqs[0].dest_addr;
+	if (dev_addr & 0x3)
+		goto invalid;
+
+	/* the entries are rewritten below, so check before touching them */
+	spin_lock_irqsave(&ch->lock, irq_flags);
+	for (i = 0; i < nents; i++) {
+		if (tegra_dma_req_queued(ch, &reqs[i])) {
+			spin_unlock_irqrestore(&ch->lock, irq_flags);
+			pr_err("DMA request already queued on channel %d\n",
+				ch->id);
+			return -EBUSY;
+		}
+	}
+	spin_unlock_irqrestore(&ch->lock, irq_flags);
+
+	for_each_sg(sgl, sg, nents, i) {
+		struct tegra_dma_req *req = &reqs[i];
+		unsigned int size = sg_dma_len(sg);
+		dma_addr_t addr = sg_dma_address(sg);
+
+		if (!size || size > NV_DMA_MAX_TRASFER_SIZE ||
+			size & 0x3 || addr & 0x3)
+			goto invalid;
+
+		if (i)
+			*req = reqs[0];
+		if (req->to_memory)
+			req->dest_addr = addr;
+		else
+			req->source_addr = addr;
+		req->size = size;
+		req->virt_addr = NULL;
+		req->bytes_transferred = 0;
+		req->status = 0;
+		req->buffer_status = 0;
+	}
+
+	spin_lock_irqsave(&ch->lock, irq_flags);
+
+	if (list_empty(&ch->list))
+		start_dma = 1;
+
+	for (i = 0; i < nents; i++)
+		list_add_tail(&reqs[i].node, &ch->list);
+
+	if (start_dma)
+		tegra_dma_update_hw(ch, &reqs[0]);
+
+	spin_unlock_irqrestore(&ch->lock, irq_flags);
+
+	return 0;
+
+invalid:
+	pr_err("Invalid DMA request for channel %d\n", ch->id);
+	return -EINVAL;
+}
+EXPORT_SYMBOL(tegra_dma_enqueue_sg);
+
 static void tegra_dma_dump_channel_usage(void)
 {
 	int i;
@@ -747,29 +860,49 @@ static void tegra_dma_init_hw(struct tegra_dma_channel *ch)
 	ch->apb_seq = APB_SEQ_BUS_WIDTH_32 | 1 << APB_SEQ_WRAP_SHIFT;
 }
 
-static void handle_oneshot_dma(struct tegra_dma_channel *ch)
+/*
+ * Called from the hard interrupt: retire the finished request and start
+ * the next queued one right away, so that back to back requests don't
+ * wait for the interrupt thread. The completion callbacks are still run
+ * from the thread, by handle_oneshot_dma().
+ */
+static void retire_oneshot_dma(struct tegra_dma_channel *ch)
 {
 	struct tegra_dma_req *req;
-	unsigned long irq_flags;
+	int bytes_transferred;
 
-	spin_lock_irqsave(&ch->lock, irq_flags);
+	spin_lock(&ch->lock);
 	if (list_empty(&ch->list)) {
-		spin_unlock_irqrestore(&ch->lock, irq_flags);
+		spin_unlock(&ch->lock);
 		return;
 	}
 
 	req = list_entry(ch->list.next, typeof(*req), node);
-	if (req) {
-		int bytes_transferred;
 
-		bytes_transferred =
-			(ch->csr & CSR_WCOUNT_MASK) >> CSR_WCOUNT_SHIFT;
-		bytes_transferred += 1;
-		bytes_transferred <<= 2;
+	bytes_transferred = (ch->csr & CSR_WCOUNT_MASK) >> CSR_WCOUNT_SHIFT;
+	bytes_transferred += 1;
+	bytes_transferred <<= 2;
+
+	req->bytes_transferred = bytes_transferred;
+	req->status = TEGRA_DMA_REQ_SUCCESS;
+	list_move_tail(&req->node, &ch->done);
+
+	if (!list_empty(&ch->list)) {
+		req = list_entry(ch->list.next, typeof(*req), node);
+		tegra_dma_update_hw(ch, req);
+	}
+	spin_unlock(&ch->lock);
+}
+
+static void handle_oneshot_dma(struct tegra_dma_channel *ch)
+{
+	struct tegra_dma_req *req;
+	unsigned long irq_flags;
 
+	spin_lock_irqsave(&ch->lock, irq_flags);
+	while (!list_empty(&ch->done)) {
+		req = list_entry(ch->done.next, typeof(*req), node);
 		list_del(&req->node);
-		req->bytes_transferred = bytes_transferred;
-		req->status = TEGRA_DMA_REQ_SUCCESS;
 
 		spin_unlock_irqrestore(&ch->lock, irq_flags);
 		/* Callback should be called without any lock */
@@ -778,14 +911,6 @@ static void handle_oneshot_dma(struct tegra_dma_channel *ch)
 		req->complete(req);
 		spin_lock_irqsave(&ch->lock, irq_flags);
 	}
-
-	if (!list_empty(&ch->list)) {
-		req = list_entry(ch->list.next, typeof(*req), node);
-		/* the complete function we just called may have enqueued another
-		   req, in which case dma has already started */
-		if (req->status != TEGRA_DMA_REQ_INFLIGHT)
-			tegra_dma_update_hw(ch, req);
-	}
 	spin_unlock_irqrestore(&ch->lock, irq_flags);
 }
 
@@ -921,6 +1046,10 @@ static irqreturn_t dma_isr(int irq, void *data)
 		pr_warning("Got a spurious ISR for DMA channel %d\n", ch->id);
 		return IRQ_HANDLED;
 	}
+
+	if (ch->mode & TEGRA_DMA_MODE_ONESHOT)
+		retire_oneshot_dma(ch);
+
 	return IRQ_WAKE_THREAD;
 }
 
@@ -970,6 +1099,7 @@ int __init tegra_dma_init(void)
 
 		spin_lock_init(&ch->lock);
 		INIT_LIST_HEAD(&ch->list);
+		INIT_LIST_HEAD(&ch->done);
 		tegra_dma_init_hw(ch);
 
 		irq = INT_APB_DMA_CH0 + i;
@@ -27,6 +27,7 @@
 
 struct tegra_dma_req;
 struct tegra_dma_channel;
+struct scatterlist;
 
 #define TEGRA_DMA_REQ_SEL_CNTR			0
 #define TEGRA_DMA_REQ_SEL_I2S_2			1
@@ -141,6 +142,8 @@ struct tegra_dma_req {
 
 int tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
 	struct tegra_dma_req *req);
+int tegra_dma_enqueue_sg(struct tegra_dma_channel *ch,
+	struct tegra_dma_req *reqs, struct scatterlist *sgl, unsigned int nents);
 int tegra_dma_dequeue_req(struct tegra_dma_channel *ch,
 	struct tegra_dma_req *req);
 void tegra_dma_dequeue(struct tegra_dma_channel *ch);
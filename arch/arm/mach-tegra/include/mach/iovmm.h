@@ -59,6 +59,9 @@ struct tegra_iovmm_domain {
 	struct rw_semaphore	map_lock;
 	struct rb_root		all_blocks;  /* ordered by address */
 	struct rb_root		free_blocks; /* ordered by size */
+	unsigned int		num_blocks;  /* protected by block_lock */
+	unsigned int		num_free;
+	tegra_iovmm_addr_t	free_size;
 	struct tegra_iovmm_device *dev;
 };
 
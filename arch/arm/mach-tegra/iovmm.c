@@ -99,28 +99,20 @@ static void tegra_iovmm_block_stats(struct tegra_iovmm_domain *domain,
 	tegra_iovmm_addr_t *max_free)
 {
 	struct rb_node *n;
-	struct tegra_iovmm_block *b;
-
-	*num_blocks = 0;
-	*num_free = 0;
-	*total = (tegra_iovmm_addr_t)0;
-	*total_free = (tegra_iovmm_addr_t)0;
-	*max_free = (tegra_iovmm_addr_t)0;
+	struct tegra_iovmm_block *first, *last;
 
 	spin_lock(&domain->block_lock);
-	n = rb_first(&domain->all_blocks);
-	while (n) {
-		b = rb_entry(n, struct tegra_iovmm_block, all_node);
-		n = rb_next(n);
-		(*num_blocks)++;
-		(*total) += iovmm_length(b);
-		if (test_bit(BK_free, &b->flags)) {
-			(*num_free)++;
-			(*total_free) += iovmm_length(b);
-			(*max_free) = max_t(tegra_iovmm_addr_t,
-				(*max_free), iovmm_length(b));
-		}
-	}
+	*num_blocks = domain->num_blocks;
+	*num_free = domain->num_free;
+	*total_free = domain->free_size;
+	first = rb_entry(rb_first(&domain->all_blocks),
+		struct tegra_iovmm_block, all_node);
+	last = rb_entry(rb_last(&domain->all_blocks),
+		struct tegra_iovmm_block, all_node);
+	*total = iovmm_end(last) - iovmm_start(first);
+	n = rb_last(&domain->free_blocks);
+	*max_free = n ? iovmm_length(rb_entry(n, struct tegra_iovmm_block,
+		free_node)) : (tegra_iovmm_addr_t)0;
 	spin_unlock(&domain->block_lock);
 }
 
@@ -187,6 +179,8 @@ static void iovmm_free_block(struct tegra_iovmm_domain *domain,
 	iovmm_block_put(block);
 
 	spin_lock(&domain->block_lock);
+	domain->num_free++;
+	domain->free_size += iovmm_length(block);
 	temp = rb_prev(&block->all_node);
 	if (temp)
 		pred = rb_entry(temp, struct tegra_iovmm_block, all_node);
@@ -206,18 +200,24 @@ static void iovmm_free_block(struct tegra_iovmm_domain *domain,
 		rb_erase(&pred->free_node, &domain->free_blocks);
 		iovmm_block_put(block);
 		iovmm_block_put(succ);
+		domain->num_blocks -= 2;
+		domain->num_free -= 2;
 		block = pred;
 	} else if (pred_free) {
 		iovmm_length(pred) += iovmm_length(block);
 		rb_erase(&block->all_node, &domain->all_blocks);
 		rb_erase(&pred->free_node, &domain->free_blocks);
 		iovmm_block_put(block);
+		domain->num_blocks--;
+		domain->num_free--;
 		block = pred;
 	} else if (succ_free) {
 		iovmm_length(block) += iovmm_length(succ);
 		rb_erase(&succ->all_node, &domain->all_blocks);
 		rb_erase(&succ->free_node, &domain->free_blocks);
 		iovmm_block_put(succ);
+		domain->num_blocks--;
+		domain->num_free--;
 	}
 
 	p = &domain->free_blocks.rb_node;
@@ -236,22 +236,19 @@ static void iovmm_free_block(struct tegra_iovmm_domain *domain,
 	spin_unlock(&domain->block_lock);
 }
 
-/* if the best-fit block is larger than the requested size, a remainder
- * block will be created and inserted into the free list in its place.
- * since all free blocks are stored in two trees the new block needs to be
- * linked into both. */
+/* if the best-fit block is larger than the requested size, the remainder
+ * block rem (allocated by the caller before taking block_lock) will be
+ * inserted into the free list in its place. since all free blocks are
+ * stored in two trees the new block needs to be linked into both. must be
+ * called with block_lock held. */
 static void iovmm_split_free_block(struct tegra_iovmm_domain *domain,
-	struct tegra_iovmm_block *block, unsigned long size)
+	struct tegra_iovmm_block *block, struct tegra_iovmm_block *rem,
+	unsigned long size)
 {
 	struct rb_node **p;
 	struct rb_node *parent = NULL;
-	struct tegra_iovmm_block *rem;
 	struct tegra_iovmm_block *b;
 
-	rem = kmem_cache_zalloc(iovmm_cache, GFP_KERNEL);
-	if (!rem) return;
-
-	spin_lock(&domain->block_lock);
 	p = &domain->free_blocks.rb_node;
 
 	iovmm_start(rem) = iovmm_start(block) + size;
@@ -283,6 +280,9 @@ static void iovmm_split_free_block(struct tegra_iovmm_domain *domain,
 	}
 	rb_link_node(&rem->all_node, parent, p);
 	rb_insert_color(&rem->all_node, &domain->all_blocks);
+	domain->num_blocks++;
+	domain->num_free++;
+	domain->free_size += iovmm_length(rem);
 }
 
 static struct tegra_iovmm_block *iovmm_alloc_block(
@@ -290,17 +290,17 @@ static struct tegra_iovmm_block *iovmm_alloc_block(
 {
 	struct rb_node *n;
 	struct tegra_iovmm_block *b, *best;
-        static int splitting = 0;
+	struct tegra_iovmm_block *rem;
 
 	BUG_ON(!size);
 	size = iovmm_align_up(domain->dev, size);
-        for (;;) {
-		spin_lock(&domain->block_lock);
-		if (!splitting)
-			break;
-		spin_unlock(&domain->block_lock);
-		schedule();
-	}
+
+	/* allocated up front, so that the whole allocation is a single
+	 * O(log n) operation under block_lock; if this fails, the best-fit
+	 * block is simply handed out unsplit */
+	rem = kmem_cache_zalloc(iovmm_cache, GFP_KERNEL);
+
+	spin_lock(&domain->block_lock);
 	n = domain->free_blocks.rb_node;
 	best = NULL;
 	while (n) {
@@ -316,19 +316,21 @@ static struct tegra_iovmm_block *iovmm_alloc_block(
 	}
 	if (!best) {
 		spin_unlock(&domain->block_lock);
+		if (rem) kmem_cache_free(iovmm_cache, rem);
 		return NULL;
 	}
 	rb_erase(&best->free_node, &domain->free_blocks);
 	clear_bit(BK_free, &best->flags);
 	atomic_inc(&best->ref);
-	if (iovmm_length(best) >= size+MIN_SPLIT_BYTES(domain)) {
-		splitting = 1;
-		spin_unlock(&domain->block_lock);
-		iovmm_split_free_block(domain, best, size);
-		splitting = 0;
+	domain->num_free--;
+	domain->free_size -= iovmm_length(best);
+	if (rem && iovmm_length(best) >= size+MIN_SPLIT_BYTES(domain)) {
+		iovmm_split_free_block(domain, best, rem, size);
+		rem = NULL;
 	}
 
 	spin_unlock(&domain->block_lock);
+	if (rem) kmem_cache_free(iovmm_cache, rem);
 
 	return best;
 }
@@ -352,6 +354,9 @@ int tegra_iovmm_domain_init(struct tegra_iovmm_domain *domain,
 	iovmm_start(b) = iovmm_align_up(dev, start);
 	iovmm_length(b) = iovmm_align_down(dev, end) - iovmm_start(b);
 	set_bit(BK_free, &b->flags);
+	domain->num_blocks = 1;
+	domain->num_free = 1;
+	domain->free_size = iovmm_length(b);
 	rb_link_node(&b->free_node, NULL, &domain->free_blocks.rb_node);
 	rb_insert_color(&b->free_node, &domain->free_blocks);
 	rb_link_node(&b->all_node, NULL, &domain->all_blocks.rb_node);
@@ -19,7 +19,9 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/tick.h>
 #include <linux/time.h>
@@ -44,6 +46,7 @@ struct cpufreq_interactive_cpuinfo {
 	struct cpufreq_policy *policy;
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
+	unsigned int predicted_freq;
 	int governor_enabled;
 };
 
@@ -78,6 +81,24 @@ static unsigned long min_sample_time;
 #define DEFAULT_TIMER_RATE 20 * USEC_PER_MSEC
 static unsigned long timer_rate;
 
+/*
+ * Weight in percent given to the newest sample of the per-CPU load history.
+ * The history predicts the speed to jump to on a load burst or an input
+ * event; 0 disables it and always uses hispeed_freq.
+ */
+#define DEFAULT_LOAD_HISTORY_WEIGHT 25
+static unsigned long load_history_weight;
+
+/*
+ * Speed to raise all CPUs to on input events (0 uses the predicted speed),
+ * and for how long it is held.  A duration of 0 disables the input boost.
+ */
+static unsigned long input_boost_freq;
+#define DEFAULT_INPUT_BOOST_DURATION 80 * USEC_PER_MSEC
+static unsigned long input_boost_duration;
+static u64 input_boost_start;
+static u64 input_boost_end;
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -91,6 +112,52 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+/*
+ * Speed to jump to when a CPU at minimum speed becomes busy.  The history
+ * follows the speed at which recent busy periods ran at go_hispeed_load.
+ */
+static unsigned int cpufreq_interactive_hispeed(
+	struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	unsigned int freq = hispeed_freq;
+
+	if (load_history_weight && pcpu->predicted_freq)
+		freq = pcpu->predicted_freq;
+
+	return clamp(freq, pcpu->policy->min, pcpu->policy->max);
+}
+
+static void cpufreq_interactive_update_history(
+	struct cpufreq_interactive_cpuinfo *pcpu, int cpu_load)
+{
+	unsigned int demand;
+
+	/* At minimum speed a busy CPU says nothing about its real demand. */
+	if (!load_history_weight || !cpu_load ||
+	    pcpu->policy->cur == pcpu->policy->min)
+		return;
+
+	demand = pcpu->policy->cur * cpu_load / go_hispeed_load;
+	if (demand > pcpu->policy->max)
+		demand = pcpu->policy->max;
+
+	if (!pcpu->predicted_freq)
+		pcpu->predicted_freq = demand;
+	else
+		pcpu->predicted_freq = (pcpu->predicted_freq *
+					(100 - load_history_weight) +
+					demand * load_history_weight) / 100;
+}
+
+static unsigned int cpufreq_interactive_boost_freq(
+	struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	if (input_boost_freq)
+		return clamp((unsigned int)input_boost_freq,
+			     pcpu->policy->min, pcpu->policy->max);
+	return cpufreq_interactive_hispeed(pcpu);
+}
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
@@ -165,13 +232,23 @@ static void cpufreq_interactive_timer(unsigned long data)
 
 	if (cpu_load >= go_hispeed_load) {
 		if (pcpu->policy->cur == pcpu->policy->min)
-			new_freq = hispeed_freq;
+			new_freq = cpufreq_interactive_hispeed(pcpu);
 		else
 			new_freq = pcpu->policy->max * cpu_load / 100;
 	} else {
 		new_freq = pcpu->policy->cur * cpu_load / 100;
 	}
 
+	cpufreq_interactive_update_history(pcpu, cpu_load);
+
+	/* Hold the input boost until it runs out. */
+	if (pcpu->timer_run_time < input_boost_end) {
+		unsigned int boost_freq = cpufreq_interactive_boost_freq(pcpu);
+
+		if (new_freq < boost_freq)
+			new_freq = boost_freq;
+	}
+
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
 					   new_freq, CPUFREQ_RELATION_H,
 					   &index)) {
@@ -433,6 +510,119 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 	}
 }
 
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+					    unsigned int type,
+					    unsigned int code, int value)
+{
+	unsigned int cpu;
+	unsigned int boost_freq;
+	unsigned int index;
+	unsigned long flags;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	int wake = 0;
+	u64 now;
+
+	if (!input_boost_duration || type == EV_SYN)
+		return;
+
+	/* A stream of events only needs to refresh the boost once a sample. */
+	now = ktime_to_us(ktime_get());
+	if (now - input_boost_start < timer_rate && now < input_boost_end)
+		return;
+	input_boost_start = now;
+	input_boost_end = now + input_boost_duration;
+
+	for_each_online_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+		smp_rmb();
+
+		if (!pcpu->governor_enabled)
+			continue;
+
+		boost_freq = cpufreq_interactive_boost_freq(pcpu);
+		if (cpufreq_frequency_table_target(pcpu->policy,
+						   pcpu->freq_table,
+						   boost_freq,
+						   CPUFREQ_RELATION_H,
+						   &index))
+			continue;
+		boost_freq = pcpu->freq_table[index].frequency;
+		if (pcpu->target_freq >= boost_freq)
+			continue;
+
+		pcpu->target_freq = boost_freq;
+		spin_lock_irqsave(&up_cpumask_lock, flags);
+		cpumask_set_cpu(cpu, &up_cpumask);
+		spin_unlock_irqrestore(&up_cpumask_lock, flags);
+		wake = 1;
+	}
+
+	if (wake)
+		wake_up_process(up_task);
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+					     struct input_dev *dev,
+					     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_register;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_open;
+
+	return 0;
+
+err_open:
+	input_unregister_handle(handle);
+err_register:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event		= cpufreq_interactive_input_event,
+	.connect	= cpufreq_interactive_input_connect,
+	.disconnect	= cpufreq_interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= cpufreq_interactive_ids,
+};
+
+/* boosting is optional, the governor still loads without it */
+static bool input_handler_registered;
+
 static ssize_t show_hispeed_freq(struct kobject *kobj,
 				 struct attribute *attr, char *buf)
 {
@@ -523,11 +713,85 @@ static ssize_t store_timer_rate(struct kobject *kobj,
 static struct global_attr timer_rate_attr = __ATTR(timer_rate, 0644,
 		show_timer_rate, store_timer_rate);
 
+static ssize_t show_load_history_weight(struct kobject *kobj,
+			struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", load_history_weight);
+}
+
+static ssize_t store_load_history_weight(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	if (val > 100)
+		return -EINVAL;
+	load_history_weight = val;
+	return count;
+}
+
+static struct global_attr load_history_weight_attr =
+	__ATTR(load_history_weight, 0644,
+	       show_load_history_weight, store_load_history_weight);
+
+static ssize_t show_input_boost_freq(struct kobject *kobj,
+			struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_freq);
+}
+
+static ssize_t store_input_boost_freq(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	input_boost_freq = val;
+	return count;
+}
+
+static struct global_attr input_boost_freq_attr =
+	__ATTR(input_boost_freq, 0644,
+	       show_input_boost_freq, store_input_boost_freq);
+
+static ssize_t show_input_boost_duration(struct kobject *kobj,
+			struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_duration);
+}
+
+static ssize_t store_input_boost_duration(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	input_boost_duration = val;
+	return count;
+}
+
+static struct global_attr input_boost_duration_attr =
+	__ATTR(input_boost_duration, 0644,
+	       show_input_boost_duration, store_input_boost_duration);
+
 static struct attribute *interactive_attributes[] = {
 	&hispeed_freq_attr.attr,
 	&go_hispeed_load_attr.attr,
 	&min_sample_time_attr.attr,
 	&timer_rate_attr.attr,
+	&load_history_weight_attr.attr,
+	&input_boost_freq_attr.attr,
+	&input_boost_duration_attr.attr,
 	NULL,
 };
 
@@ -556,6 +820,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 			pcpu = &per_cpu(cpuinfo, j);
 			pcpu->policy = policy;
 			pcpu->target_freq = policy->cur;
+			pcpu->predicted_freq = 0;
 			pcpu->freq_table = freq_table;
 			pcpu->freq_change_time_in_idle =
 				get_cpu_idle_time_us(j,
@@ -641,12 +906,15 @@ static struct notifier_block cpufreq_interactive_idle_nb = {
 static int __init cpufreq_interactive_init(void)
 {
 	unsigned int i;
+	int ret;
 	struct cpufreq_interactive_cpuinfo *pcpu;
 	struct sched_param param = { .sched_priority = MAX_RT_PRIO-1 };
 
 	go_hispeed_load = DEFAULT_GO_HISPEED_LOAD;
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
 	timer_rate = DEFAULT_TIMER_RATE;
+	load_history_weight = DEFAULT_LOAD_HISTORY_WEIGHT;
+	input_boost_duration = DEFAULT_INPUT_BOOST_DURATION;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
@@ -680,7 +948,17 @@ static int __init cpufreq_interactive_init(void)
 
 	idle_notifier_register(&cpufreq_interactive_idle_nb);
 
-	return cpufreq_register_governor(&cpufreq_gov_interactive);
+	if (input_register_handler(&cpufreq_interactive_input_handler))
+		pr_warn("%s: failed to register input handler\n", __func__);
+	else
+		input_handler_registered = true;
+
+	ret = cpufreq_register_governor(&cpufreq_gov_interactive);
+	if (ret && input_handler_registered) {
+		input_unregister_handler(&cpufreq_interactive_input_handler);
+		input_handler_registered = false;
+	}
+	return ret;
 
 err_freeuptask:
 	put_task_struct(up_task);
@@ -696,6 +974,8 @@ module_init(cpufreq_interactive_init);
 static void __exit cpufreq_interactive_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_interactive);
+	if (input_handler_registered)
+		input_unregister_handler(&cpufreq_interactive_input_handler);
 	kthread_stop(up_task);
 	put_task_struct(up_task);
 	destroy_workqueue(down_wq);
@@ -183,6 +183,7 @@ struct tegra_aes_ctx {
 	struct tegra_aes_dev *dd;
 	unsigned long flags;
 	struct tegra_aes_slot *slot;
+	u8 key[AES_MAX_KEY_SIZE];	/* loaded into the slot per request */
 	int keylen;
 };
 
@@ -340,11 +341,11 @@ static int aes_start_crypt(struct tegra_aes_dev *dd, u32 in_addr, u32 out_addr,
 	return 0;
 }
 
-static void aes_release_key_slot(struct tegra_aes_dev *dd)
+static void aes_release_key_slot(struct tegra_aes_ctx *ctx)
 {
 	spin_lock(&list_lock);
-	dd->ctx->slot->available = true;
-	dd->ctx->slot = NULL;
+	ctx->slot->available = true;
+	ctx->slot = NULL;
 	spin_unlock(&list_lock);
 }
 
@@ -490,7 +491,8 @@ static int tegra_aes_handle_req(struct tegra_aes_dev *dd)
 
 	if (!in_sg || !out_sg) {
 		mutex_unlock(&aes_lock);
-		return -EINVAL;
+		ret = -EINVAL;
+		goto complete;
 	}
 
 	total = dd->total;
@@ -518,7 +520,8 @@ static int tegra_aes_handle_req(struct tegra_aes_dev *dd)
 	if (tegra_arb_mutex_lock_timeout(dd->res_id, ARB_SEMA_TIMEOUT) < 0) {
 		dev_err(dd->dev, "aes hardware not available\n");
 		mutex_unlock(&aes_lock);
-		return -EBUSY;
+		ret = -EBUSY;
+		goto complete;
 	}
 
 	ret = aes_hw_init(dd);
@@ -527,6 +530,11 @@ static int tegra_aes_handle_req(struct tegra_aes_dev *dd)
 		goto fail;
 	}
 
+	/* the key table is shared, so load this tfm's key every time */
+	if (ctx->slot && ctx->slot != &ssk) {
+		memset(dd->ivkey_base, 0, AES_HW_KEY_TABLE_LENGTH_BYTES);
+		memcpy(dd->ivkey_base, ctx->key, ctx->keylen);
+	}
 	aes_set_key(dd);
 
 	/* set iv to the aes hw slot */
@@ -546,6 +554,7 @@ static int tegra_aes_handle_req(struct tegra_aes_dev *dd)
 		ret = dma_map_sg(dd->dev, in_sg, 1, DMA_TO_DEVICE);
 		if (!ret) {
 			dev_err(dd->dev, "dma_map_sg() error\n");
+			ret = -EINVAL;
 			goto out;
 		}
 
@@ -554,6 +563,7 @@ static int tegra_aes_handle_req(struct tegra_aes_dev *dd)
 				dev_err(dd->dev, "dma_map_sg() error\n");
 				dma_unmap_sg(dd->dev, dd->in_sg,
 					1, DMA_TO_DEVICE);
+				ret = -EINVAL;
 				goto out;
 			}
 
@@ -595,11 +605,14 @@ fail:
 	/* release the mutex */
 	mutex_unlock(&aes_lock);
 
-	if (dd->req->base.complete)
-		dd->req->base.complete(&dd->req->base, ret);
+complete:
+	if (req->base.complete)
+		req->base.complete(&req->base, ret);
 
 	dev_info(dd->dev, "%s: exit\n", __func__);
-	return ret;
+
+	/* any error went to the request; keep servicing the queue */
+	return 0;
 }
 
 static int tegra_aes_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
@@ -624,10 +637,9 @@ static int tegra_aes_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
 	dev_dbg(dd->dev, "keylen: %d\n", keylen);
 
 	ctx->dd = dd;
-	dd->ctx = ctx;
 
-	if (ctx->slot)
-		aes_release_key_slot(dd);
+	if (ctx->slot && ctx->slot != &ssk)
+		aes_release_key_slot(ctx);
 
 	key_slot = aes_find_key_slot(dd);
 	if (!key_slot) {
@@ -639,9 +651,8 @@ static int tegra_aes_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
 	ctx->keylen = keylen;
 	ctx->flags |= FLAGS_NEW_KEY;
 
-	/* copy the key */
-	memset(dd->ivkey_base, 0, AES_HW_KEY_TABLE_LENGTH_BYTES);
-	memcpy(dd->ivkey_base, key, keylen);
+	/* copy the key; it is loaded when a request is handled */
+	memcpy(ctx->key, key, keylen);
 
 	dev_dbg(dd->dev, "done\n");
 	return 0;
@@ -884,6 +895,14 @@ static int tegra_aes_cra_init(struct crypto_tfm *tfm)
 	return 0;
 }
 
+static void tegra_aes_cra_exit(struct crypto_tfm *tfm)
+{
+	struct tegra_aes_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	if (ctx->slot && ctx->slot != &ssk)
+		aes_release_key_slot(ctx);
+}
+
 static struct crypto_alg algs[] = {
 	{
 		.cra_name = "disabled_ecb(aes)",
@@ -896,6 +915,7 @@ static struct crypto_alg algs[] = {
 		.cra_type = &crypto_ablkcipher_type,
 		.cra_module = THIS_MODULE,
 		.cra_init = tegra_aes_cra_init,
+		.cra_exit = tegra_aes_cra_exit,
 		.cra_u.ablkcipher = {
 			.min_keysize = AES_MIN_KEY_SIZE,
 			.max_keysize = AES_MAX_KEY_SIZE,
@@ -914,6 +934,7 @@ static struct crypto_alg algs[] = {
 		.cra_type = &crypto_ablkcipher_type,
 		.cra_module = THIS_MODULE,
 		.cra_init = tegra_aes_cra_init,
+		.cra_exit = tegra_aes_cra_exit,
 		.cra_u.ablkcipher = {
 			.min_keysize = AES_MIN_KEY_SIZE,
 			.max_keysize = AES_MAX_KEY_SIZE,
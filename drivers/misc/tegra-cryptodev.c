@@ -30,17 +30,41 @@
 #include <linux/crypto.h>
 #include <linux/scatterlist.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <crypto/rng.h>
 
 #include "tegra-cryptodev.h"
 
 #define NBUFS 2
+#define TEGRA_CRYPTO_RELEASE_TIMEOUT_MS	5000
+
+/* key last set on a tfm, so that batches reusing it don't have to drain */
+struct tegra_crypt_key {
+	char key[TEGRA_CRYPTO_MAX_KEY_SIZE];
+	int keylen;			/* 0 if unknown */
+};
 
 struct tegra_crypto_ctx {
 	struct crypto_ablkcipher *ecb_tfm;
 	struct crypto_ablkcipher *cbc_tfm;
 	struct crypto_rng *rng;
 	int use_ssk;
+
+	/* asynchronous requests */
+	struct mutex submit_lock;	/* serializes submitters and setkey */
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	struct list_head done;		/* finished, result not collected */
+	int njobs;			/* in flight or not collected */
+	int inflight;
+	unsigned int next_id;
+	struct tegra_crypt_key ecb_key;	/* under submit_lock */
+	struct tegra_crypt_key cbc_key;
 };
 
 struct tegra_crypto_completion {
@@ -48,6 +72,22 @@ struct tegra_crypto_completion {
 	int req_err;
 };
 
+/* an asynchronous request, working on pinned user pages */
+struct tegra_crypt_job {
+	struct list_head node;
+	struct tegra_crypto_ctx *ctx;
+	struct ablkcipher_request *req;
+	unsigned int id;
+	int status;
+	struct page **in_pages;
+	int in_npages;
+	struct page **out_pages;
+	int out_npages;
+	struct scatterlist *in_sg;
+	struct scatterlist *out_sg;
+	char iv[TEGRA_CRYPTO_IV_SIZE];
+};
+
 static int alloc_bufs(unsigned long *buf[NBUFS])
 {
 	int i;
@@ -112,6 +152,11 @@ static int tegra_crypto_dev_open(struct inode *inode, struct file *filp)
 		goto fail_rng;
 	}
 
+	mutex_init(&ctx->submit_lock);
+	spin_lock_init(&ctx->lock);
+	init_waitqueue_head(&ctx->wq);
+	INIT_LIST_HEAD(&ctx->done);
+
 	filp->private_data = ctx;
 	return ret;
 
@@ -126,9 +171,48 @@ fail_ecb:
 	return ret;
 }
 
+static void tegra_crypt_job_free(struct tegra_crypt_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->in_npages; i++)
+		put_page(job->in_pages[i]);
+	for (i = 0; i < job->out_npages; i++) {
+		set_page_dirty_lock(job->out_pages[i]);
+		put_page(job->out_pages[i]);
+	}
+	kfree(job->in_pages);
+	kfree(job->out_pages);
+	kfree(job->in_sg);
+	if (job->req)
+		ablkcipher_request_free(job->req);
+	kfree(job);
+}
+
 static int tegra_crypto_dev_release(struct inode *inode, struct file *filp)
 {
 	struct tegra_crypto_ctx *ctx = filp->private_data;
+	struct tegra_crypt_job *job, *tmp;
+
+	/*
+	 * Requests can't be taken back from the hardware.  The aes driver
+	 * completes every request it dequeues, so this only times out if
+	 * the engine is wedged; leak ctx then rather than free memory the
+	 * hardware may still write.
+	 */
+	if (!wait_event_timeout(ctx->wq, !ctx->inflight,
+			msecs_to_jiffies(TEGRA_CRYPTO_RELEASE_TIMEOUT_MS))) {
+		pr_err("%s: %d requests stuck, leaking context\n", __func__,
+			ctx->inflight);
+		filp->private_data = NULL;
+		return 0;
+	}
+	/* let the last completion finish touching ctx */
+	spin_lock_irq(&ctx->lock);
+	spin_unlock_irq(&ctx->lock);
+
+	list_for_each_entry_safe(job, tmp, &ctx->done, node)
+		tegra_crypt_job_free(job);
 
 	crypto_free_ablkcipher(ctx->ecb_tfm);
 	crypto_free_ablkcipher(ctx->cbc_tfm);
@@ -252,11 +336,357 @@ process_req_out:
 	return ret;
 }
 
+static void tegra_crypt_job_done(struct crypto_async_request *req, int err)
+{
+	struct tegra_crypt_job *job = req->data;
+	struct tegra_crypto_ctx *ctx = job->ctx;
+	unsigned long flags;
+
+	if (err == -EINPROGRESS)
+		return;
+
+	job->status = (err < 0) ? err : 0;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	list_add_tail(&job->node, &ctx->done);
+	ctx->inflight--;
+	wake_up(&ctx->wq);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+}
+
+static int tegra_crypt_pin(unsigned long uaddr, int size, int write,
+	struct page ***pages, int *npages)
+{
+	int n = ((uaddr + size - 1) >> PAGE_SHIFT) - (uaddr >> PAGE_SHIFT) + 1;
+	int ret;
+
+	*pages = kmalloc(n * sizeof(**pages), GFP_KERNEL);
+	if (!*pages)
+		return -ENOMEM;
+
+	down_read(&current->mm->mmap_sem);
+	ret = get_user_pages(current, current->mm, uaddr & PAGE_MASK, n,
+		write, 0, *pages, NULL);
+	up_read(&current->mm->mmap_sem);
+
+	if (ret > 0)
+		*npages = ret;
+	if (ret < n)
+		return (ret < 0) ? ret : -EFAULT;
+	return 0;
+}
+
+/*
+ * Pin the user buffers and describe them with a pair of scatterlists.
+ * The aes driver walks src and dst in lockstep, so both are split at the
+ * page boundaries of either buffer to keep the entry lengths equal.
+ */
+static struct tegra_crypt_job *tegra_crypt_job_alloc(
+	struct tegra_crypto_ctx *ctx, struct crypto_ablkcipher *tfm,
+	struct tegra_crypt_req *crypt_req)
+{
+	struct tegra_crypt_job *job;
+	unsigned long in = (unsigned long)crypt_req->plaintext;
+	unsigned long out = (unsigned long)crypt_req->result;
+	unsigned int in_off, out_off, len;
+	int size = crypt_req->plaintext_sz;
+	int i = 0, j = 0, n = 0, nsg;
+	int ret;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return ERR_PTR(-ENOMEM);
+
+	job->ctx = ctx;
+	memcpy(job->iv, crypt_req->iv, sizeof(job->iv));
+
+	ret = tegra_crypt_pin(in, size, 0, &job->in_pages, &job->in_npages);
+	if (ret < 0)
+		goto fail;
+	ret = tegra_crypt_pin(out, size, 1, &job->out_pages, &job->out_npages);
+	if (ret < 0)
+		goto fail;
+
+	nsg = job->in_npages + job->out_npages;
+	job->in_sg = kmalloc(2 * nsg * sizeof(struct scatterlist), GFP_KERNEL);
+	if (!job->in_sg) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	job->out_sg = job->in_sg + nsg;
+	sg_init_table(job->in_sg, nsg);
+	sg_init_table(job->out_sg, nsg);
+
+	in_off = in & ~PAGE_MASK;
+	out_off = out & ~PAGE_MASK;
+	while (size) {
+		len = min3((unsigned int)size, (unsigned int)PAGE_SIZE - in_off,
+			(unsigned int)PAGE_SIZE - out_off);
+		sg_set_page(&job->in_sg[n], job->in_pages[i], len, in_off);
+		sg_set_page(&job->out_sg[n], job->out_pages[j], len, out_off);
+		n++;
+		size -= len;
+
+		in_off += len;
+		if (in_off == PAGE_SIZE) {
+			in_off = 0;
+			i++;
+		}
+		out_off += len;
+		if (out_off == PAGE_SIZE) {
+			out_off = 0;
+			j++;
+		}
+	}
+	sg_mark_end(&job->in_sg[n - 1]);
+	sg_mark_end(&job->out_sg[n - 1]);
+
+	job->req = ablkcipher_request_alloc(tfm, GFP_KERNEL);
+	if (!job->req) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ablkcipher_request_set_callback(job->req, CRYPTO_TFM_REQ_MAY_BACKLOG,
+		tegra_crypt_job_done, job);
+	ablkcipher_request_set_crypt(job->req, job->in_sg, job->out_sg,
+		crypt_req->plaintext_sz, job->iv);
+
+	return job;
+
+fail:
+	tegra_crypt_job_free(job);
+	return ERR_PTR(ret);
+}
+
+static int tegra_crypt_check_req(struct tegra_crypto_ctx *ctx,
+	struct tegra_crypt_req *crypt_req)
+{
+	unsigned long in = (unsigned long)crypt_req->plaintext;
+	unsigned long out = (unsigned long)crypt_req->result;
+	int size = crypt_req->plaintext_sz;
+
+	if ((size <= 0) || (size > TEGRA_CRYPTO_MAX_ASYNC_SIZE) ||
+	    !IS_ALIGNED(in | out | size, AES_BLOCK_SIZE))
+		return -EINVAL;
+
+	/* a zero keylen would make the aes driver fall back to the ssk */
+	if (!ctx->use_ssk && (crypt_req->keylen != AES_KEYSIZE_128) &&
+	    (crypt_req->keylen != AES_KEYSIZE_192) &&
+	    (crypt_req->keylen != AES_KEYSIZE_256))
+		return -EINVAL;
+
+	return 0;
+}
+
+static bool tegra_crypt_key_changed(struct tegra_crypt_key *cur,
+	struct tegra_crypt_req *crypt_req)
+{
+	return crypt_req && ((cur->keylen != crypt_req->keylen) ||
+		memcmp(cur->key, crypt_req->key, crypt_req->keylen));
+}
+
+/* Called with submit_lock held and nothing in flight. */
+static int tegra_crypt_set_key(struct crypto_ablkcipher *tfm,
+	struct tegra_crypt_key *cur, struct tegra_crypt_req *crypt_req)
+{
+	int ret;
+
+	if (!tegra_crypt_key_changed(cur, crypt_req))
+		return 0;
+
+	cur->keylen = 0;
+	crypto_ablkcipher_clear_flags(tfm, ~0);
+	ret = crypto_ablkcipher_setkey(tfm, crypt_req->key, crypt_req->keylen);
+	if (ret < 0) {
+		pr_err("setkey failed");
+		return ret;
+	}
+
+	memcpy(cur->key, crypt_req->key, crypt_req->keylen);
+	cur->keylen = crypt_req->keylen;
+	return 0;
+}
+
+static int tegra_crypt_start_job(struct tegra_crypto_ctx *ctx,
+	struct tegra_crypt_req *crypt_req, unsigned int id)
+{
+	struct crypto_ablkcipher *tfm;
+	struct tegra_crypt_job *job;
+	unsigned long flags;
+	int ret;
+
+	tfm = (crypt_req->op & TEGRA_CRYPTO_ECB) ? ctx->ecb_tfm : ctx->cbc_tfm;
+
+	job = tegra_crypt_job_alloc(ctx, tfm, crypt_req);
+	if (IS_ERR(job))
+		return PTR_ERR(job);
+	job->id = id;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	ctx->inflight++;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	ret = crypt_req->encrypt ?
+		crypto_ablkcipher_encrypt(job->req) :
+		crypto_ablkcipher_decrypt(job->req);
+
+	/* completed or failed right away: no callback will follow */
+	if ((ret != -EINPROGRESS) && (ret != -EBUSY))
+		tegra_crypt_job_done(&job->req->base, ret);
+
+	return 0;
+}
+
+static int tegra_crypt_submit_reqs(struct tegra_crypto_ctx *ctx,
+	struct tegra_crypt_submit *submit)
+{
+	struct tegra_crypt_req *reqs, *ecb = NULL, *cbc = NULL, **key;
+	unsigned long flags;
+	int nreqs = submit->nreqs;
+	int i = 0, ret = 0;
+
+	submit->nreqs = 0;
+	if ((nreqs <= 0) || (nreqs > TEGRA_CRYPTO_MAX_BATCH))
+		return -EINVAL;
+
+	reqs = kmalloc(nreqs * sizeof(*reqs), GFP_KERNEL);
+	if (!reqs)
+		return -ENOMEM;
+
+	if (copy_from_user(reqs, (void __user *)submit->reqs,
+			nreqs * sizeof(*reqs))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	/* one key per mode per batch, see tegra-cryptodev.h */
+	for (i = 0; i < nreqs; i++) {
+		ret = tegra_crypt_check_req(ctx, &reqs[i]);
+		if (ret < 0)
+			goto out;
+		if (ctx->use_ssk)
+			continue;
+		key = (reqs[i].op & TEGRA_CRYPTO_ECB) ? &ecb : &cbc;
+		if (!*key)
+			*key = &reqs[i];
+		else if (((*key)->keylen != reqs[i].keylen) ||
+			 memcmp((*key)->key, reqs[i].key, reqs[i].keylen)) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (ctx->njobs + nreqs > TEGRA_CRYPTO_MAX_ASYNC_REQS) {
+		spin_unlock_irqrestore(&ctx->lock, flags);
+		ret = -EBUSY;
+		goto out;
+	}
+	ctx->njobs += nreqs;
+	submit->id = ctx->next_id;
+	ctx->next_id += nreqs;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	/*
+	 * The aes driver loads the tfm key for each request it runs, so
+	 * a key may only change once nothing is queued; batches with the
+	 * same keys as before are queued behind the running ones.  This is
+	 * the only place a signal can interrupt: once a request is queued
+	 * the ioctl must not be restarted.
+	 */
+	i = 0;
+	if (tegra_crypt_key_changed(&ctx->ecb_key, ecb) ||
+	    tegra_crypt_key_changed(&ctx->cbc_key, cbc))
+		ret = wait_event_interruptible(ctx->wq, !ctx->inflight);
+	if (!ret)
+		ret = tegra_crypt_set_key(ctx->ecb_tfm, &ctx->ecb_key, ecb);
+	if (!ret)
+		ret = tegra_crypt_set_key(ctx->cbc_tfm, &ctx->cbc_key, cbc);
+
+	for (; !ret && (i < nreqs); i++) {
+		ret = tegra_crypt_start_job(ctx, &reqs[i], submit->id + i);
+		if (ret < 0)
+			break;
+	}
+	submit->nreqs = i;
+	/* a partial batch is reported through nreqs */
+	if (i)
+		ret = 0;
+
+	if (i < nreqs) {
+		spin_lock_irqsave(&ctx->lock, flags);
+		ctx->njobs -= nreqs - i;
+		spin_unlock_irqrestore(&ctx->lock, flags);
+	}
+
+out:
+	kfree(reqs);
+	return ret;
+}
+
+static int tegra_crypt_get_results(struct tegra_crypto_ctx *ctx,
+	struct tegra_crypt_results *res)
+{
+	struct tegra_crypt_result *results;
+	struct tegra_crypt_job *job, *tmp;
+	LIST_HEAD(reaped);
+	int n = min(res->nresults, TEGRA_CRYPTO_MAX_ASYNC_REQS);
+	int i, ret = 0;
+
+	res->nresults = 0;
+	if (n <= 0)
+		return -EINVAL;
+
+	results = kmalloc(n * sizeof(*results), GFP_KERNEL);
+	if (!results)
+		return -ENOMEM;
+
+	spin_lock_irq(&ctx->lock);
+	for (i = 0; (i < n) && !list_empty(&ctx->done); i++) {
+		job = list_first_entry(&ctx->done, struct tegra_crypt_job,
+			node);
+		list_move_tail(&job->node, &reaped);
+		results[i].id = job->id;
+		results[i].status = job->status;
+	}
+	ctx->njobs -= i;
+	spin_unlock_irq(&ctx->lock);
+
+	list_for_each_entry_safe(job, tmp, &reaped, node)
+		tegra_crypt_job_free(job);
+
+	res->nresults = i;
+	if (i && copy_to_user((void __user *)res->results, results,
+			i * sizeof(*results)))
+		ret = -EFAULT;
+
+	kfree(results);
+	return ret;
+}
+
+static unsigned int tegra_crypto_dev_poll(struct file *filp, poll_table *wait)
+{
+	struct tegra_crypto_ctx *ctx = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &ctx->wq, wait);
+
+	spin_lock_irq(&ctx->lock);
+	if (!list_empty(&ctx->done))
+		mask = POLLIN | POLLRDNORM;
+	spin_unlock_irq(&ctx->lock);
+
+	return mask;
+}
+
 static long tegra_crypto_dev_ioctl(struct file *filp,
 	unsigned int ioctl_num, unsigned long arg)
 {
 	struct tegra_crypto_ctx *ctx = filp->private_data;
 	struct tegra_crypt_req crypt_req;
+	struct tegra_crypt_submit submit;
+	struct tegra_crypt_results results;
 	struct tegra_rng_req rng_req;
 	char *rng;
 	int ret = 0;
@@ -272,15 +702,52 @@ static long tegra_crypto_dev_ioctl(struct file *filp,
 			break;
 		}
 
-		ret = process_crypt_req(ctx, &crypt_req);
+		/* shares the tfms, and their keys, with queued requests */
+		mutex_lock(&ctx->submit_lock);
+		ret = wait_event_interruptible(ctx->wq, !ctx->inflight);
+		if (!ret) {
+			/* sets the key itself, outside of the cache */
+			ctx->ecb_key.keylen = 0;
+			ctx->cbc_key.keylen = 0;
+			ret = process_crypt_req(ctx, &crypt_req);
+		}
+		mutex_unlock(&ctx->submit_lock);
+		break;
+
+	case TEGRA_CRYPTO_IOCTL_SUBMIT_REQS:
+		if (copy_from_user(&submit, (void __user *)arg, sizeof(submit)))
+			return -EFAULT;
+
+		mutex_lock(&ctx->submit_lock);
+		ret = tegra_crypt_submit_reqs(ctx, &submit);
+		mutex_unlock(&ctx->submit_lock);
+
+		if (copy_to_user((void __user *)arg, &submit, sizeof(submit)))
+			ret = -EFAULT;
+		break;
+
+	case TEGRA_CRYPTO_IOCTL_GET_RESULTS:
+		if (copy_from_user(&results, (void __user *)arg,
+				sizeof(results)))
+			return -EFAULT;
+
+		ret = tegra_crypt_get_results(ctx, &results);
+
+		if (copy_to_user((void __user *)arg, &results, sizeof(results)))
+			ret = -EFAULT;
 		break;
 
 	case TEGRA_CRYPTO_IOCTL_SET_SEED:
 		if (copy_from_user(&rng_req, (void __user *)arg, sizeof(rng_req)))
 			return -EFAULT;
 
-		ret = crypto_rng_reset(ctx->rng, rng_req.seed,
-			crypto_rng_seedsize(ctx->rng));
+		/* the rng shares the aes engine's key table with the tfms */
+		mutex_lock(&ctx->submit_lock);
+		ret = wait_event_interruptible(ctx->wq, !ctx->inflight);
+		if (!ret)
+			ret = crypto_rng_reset(ctx->rng, rng_req.seed,
+				crypto_rng_seedsize(ctx->rng));
+		mutex_unlock(&ctx->submit_lock);
 		break;
 	case TEGRA_CRYPTO_IOCTL_GET_RANDOM:
 		if (copy_from_user(&rng_req, (void __user *)arg, sizeof(rng_req)))
@@ -322,6 +789,7 @@ struct file_operations tegra_crypto_fops = {
 	.owner = THIS_MODULE,
 	.open = tegra_crypto_dev_open,
 	.release = tegra_crypto_dev_release,
+	.poll = tegra_crypto_dev_poll,
 	.unlocked_ioctl = tegra_crypto_dev_ioctl,
 };
 
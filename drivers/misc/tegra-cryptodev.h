@@ -28,11 +28,18 @@
 #define TEGRA_CRYPTO_IOCTL_PROCESS_REQ	_IOWR(0x98, 101, int*)
 #define TEGRA_CRYPTO_IOCTL_SET_SEED	_IOWR(0x98, 102, int*)
 #define TEGRA_CRYPTO_IOCTL_GET_RANDOM	_IOWR(0x98, 103, int*)
+#define TEGRA_CRYPTO_IOCTL_SUBMIT_REQS	_IOWR(0x98, 104, int*)
+#define TEGRA_CRYPTO_IOCTL_GET_RESULTS	_IOWR(0x98, 105, int*)
 
 #define TEGRA_CRYPTO_MAX_KEY_SIZE	AES_MAX_KEY_SIZE
 #define TEGRA_CRYPTO_IV_SIZE	AES_BLOCK_SIZE
 #define DEFAULT_RNG_BLK_SZ	16
 
+/* limits for asynchronous requests */
+#define TEGRA_CRYPTO_MAX_BATCH		32	/* per submit */
+#define TEGRA_CRYPTO_MAX_ASYNC_REQS	64	/* queued or not collected */
+#define TEGRA_CRYPTO_MAX_ASYNC_SIZE	(1 << 20)
+
 /* the seed consists of 16 bytes of key + 16 bytes of init vector */
 #define TEGRA_CRYPTO_RNG_SEED_SIZE	AES_KEYSIZE_128 + DEFAULT_RNG_BLK_SZ
 
@@ -66,4 +73,34 @@ struct tegra_rng_req {
 	int nbytes; /* random data length */
 };
 
+/* a pointer to this struct needs to be passed to:
+ * TEGRA_CRYPTO_IOCTL_SUBMIT_REQS
+ *
+ * The requests are run directly on the user buffers, so plaintext and
+ * result must be AES_BLOCK_SIZE aligned, plaintext_sz a multiple of it, and
+ * the buffers must not be touched until the result has been collected.
+ * All ECB requests of a batch must use the same key, as must all CBC
+ * requests; a batch with a new key waits for earlier requests to finish.
+ * Requests are numbered consecutively from id; the device polls readable
+ * once results can be collected with TEGRA_CRYPTO_IOCTL_GET_RESULTS.
+ */
+struct tegra_crypt_submit {
+	struct tegra_crypt_req *reqs;
+	int nreqs; /* in: number of requests, out: number queued */
+	unsigned int id; /* out: id of reqs[0] */
+};
+
+struct tegra_crypt_result {
+	unsigned int id;
+	int status; /* 0, or a negative error code */
+};
+
+/* a pointer to this struct needs to be passed to:
+ * TEGRA_CRYPTO_IOCTL_GET_RESULTS
+ */
+struct tegra_crypt_results {
+	struct tegra_crypt_result *results;
+	int nresults; /* in: room in results, out: number returned */
+};
+
 #endif
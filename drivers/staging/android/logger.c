@@ -20,11 +20,19 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,35 +41,111 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Positions in the log are byte sequence numbers that only ever grow; the
+ * offset into the ring is the sequence number modulo the size of the log.
+ * Writers reserve space by advancing 'w_seq' under the spinlock 'lock', copy
+ * their entry in without it and then publish it by advancing 'c_seq' in
+ * reservation order. Before a reservation overwrites old entries, 'head' is
+ * pulled forward past them, so a reader that finds its position behind 'head'
+ * knows it was lapped. Readers never take 'lock'.
+ *
+ * The ring is preceded by a page holding a struct logger_mmap_header, which
+ * mirrors 'head' and 'c_seq' for readers that map the log.
+ *
+ * With CONFIG_ANDROID_LOGGER_COMPRESS, entries are also sealed into LZO
+ * compressed chunks behind the writers, and readers that were lapped carry
+ * on from those before rejoining the ring. See struct logger_archive.
+ */
+
+/* uncompressed size a chunk is sealed at, and its upper bound */
+#define LOGGER_CHUNK_SIZE	(16*1024)
+#define LOGGER_CHUNK_MAX	(LOGGER_CHUNK_SIZE + LOGGER_ENTRY_MAX_LEN)
+
+/*
+ * struct logger_chunk - a run of whole entries, compressed
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_archive's list */
+	size_t			start;	/* sequence number of the first entry */
+	size_t			len;	/* uncompressed length */
+	size_t			clen;	/* compressed length */
+	unsigned char		data[0];
+};
+
+/*
+ * struct logger_archive - compressed history of a log
+ *
+ * Chunks are sealed by 'work' from committed entries in the ring and are
+ * dropped oldest first once they take up more than logger_archive_size
+ * bytes. Everything is protected by 'mutex'.
  */
+struct logger_archive {
+	struct mutex		mutex;	/* protects the archive */
+	struct list_head	chunks;	/* oldest first */
+	size_t			end;	/* sealed up to here */
+	size_t			bytes;	/* compressed bytes held */
+	struct work_struct	work;	/* seals new chunks */
+	u64			in;	/* bytes ever sealed ... */
+	u64			out;	/* ... and what they compressed to */
+	u64			compress_ns;
+	u64			decompress_ns;
+	unsigned long		sealed;	/* chunks sealed */
+	unsigned long		dropped; /* chunks dropped for space */
+	unsigned long		unpacked; /* chunks decompressed by readers */
+	u64			skipped; /* bytes lost before being sealed */
+	struct dentry		*debugfs; /* stats file */
+};
+
 struct logger_log {
+	struct logger_mmap_header *ctl;	/* control page, followed by the ring */
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* serializes reservations */
+	size_t			w_seq;	/* end of the last reservation */
+	size_t			c_seq;	/* end of the last committed entry */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct logger_archive	archive; /* compressed history */
+#endif
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads on this file */
+	size_t			r_seq;	/* current read position */
+	int			batch;	/* read as many entries as fit */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	unsigned char		*unpacked; /* last chunk read from the archive */
+	size_t			unpacked_start;	/* and where it starts */
+#endif
+};
+
+/*
+ * struct logger_stage - per-cpu staging buffer an entry is assembled in
+ * before it is copied into the log. Only used with preemption disabled.
+ */
+struct logger_stage {
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN];
 };
 
+static struct logger_stage __percpu *logger_stage;
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_before - is sequence number 'a' before 'b'? */
+#define logger_before(a, b)	((long)((a) - (b)) < 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -89,7 +173,8 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The entry must be committed. A reader must check it was not lapped before
+ * trusting the result.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,17 +192,42 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * logger_lapped - has the writer overwritten the reader's position?
+ *
+ * Caller must hold reader->mutex.
+ */
+static int logger_lapped(struct logger_log *log, struct logger_reader *reader)
+{
+	smp_rmb();
+	return logger_before(reader->r_seq, ACCESS_ONCE(log->head));
+}
+
+/*
+ * logger_readable - is there a committed entry at the reader's position?
+ * Pairs with the smp_wmb() before 'c_seq' is advanced in logger_commit().
+ */
+static int logger_readable(struct logger_log *log, struct logger_reader *reader)
+{
+	int ret = (ACCESS_ONCE(log->c_seq) != reader->r_seq);
+
+	smp_rmb();
+	return ret;
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * user-space buffer 'buf'. Returns 'count' on success. The read position is
+ * not advanced; the caller does that once it checked it was not lapped.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_seq);
 	size_t len;
 
 	/*
@@ -125,8 +235,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,11 +247,502 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+
+/* how many compressed bytes of history to keep per log */
+static unsigned int logger_archive_size = 256 * 1024;
+module_param_named(archive_size, logger_archive_size, uint,
+		   S_IWUSR | S_IRUGO);
+
+static struct workqueue_struct *logger_archive_wq;
+static struct dentry *logger_debugfs_root;
+
+/* scratch buffers, only used from the single threaded logger_archive_wq */
+static unsigned char *logger_chunk_src;
+static unsigned char *logger_chunk_dst;
+static void *logger_lzo_wrkmem;
+
+static void logger_drop_chunk(struct logger_archive *ar,
+			      struct logger_chunk *chunk)
+{
+	ar->bytes -= chunk->clen;
+	list_del(&chunk->list);
+	kfree(chunk);
+}
+
+/*
+ * logger_archive_work - seals every full chunk's worth of committed entries
+ * into the archive. If the writers lapped us, whatever they overwrote is
+ * lost and sealing carries on from the log head.
+ */
+static void logger_archive_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      archive.work);
+	struct logger_archive *ar = &log->archive;
+	struct logger_chunk *chunk;
+	size_t start, end, c_seq, head, off, len, clen;
+	ktime_t t;
+	int ret;
+
+	mutex_lock(&ar->mutex);
+	while (1) {
+		c_seq = ACCESS_ONCE(log->c_seq);
+		smp_rmb();
+		head = ACCESS_ONCE(log->head);
+		if (logger_before(ar->end, head)) {
+			ar->skipped += head - ar->end;
+			ar->end = head;
+		}
+		start = ar->end;
+		if (c_seq - start < LOGGER_CHUNK_SIZE)
+			break;
+
+		/* seal whole entries only */
+		end = start;
+		while (end - start < LOGGER_CHUNK_SIZE)
+			end += get_entry_len(log, logger_offset(end));
+		if (unlikely(end - start > LOGGER_CHUNK_MAX ||
+			     logger_before(c_seq, end))) {
+			/* we can only have read garbage if we were lapped */
+			smp_rmb();
+			if (logger_before(start, ACCESS_ONCE(log->head)))
+				continue;
+			WARN_ON_ONCE(1);
+			break;
+		}
+
+		off = logger_offset(start);
+		len = min(end - start, log->size - off);
+		memcpy(logger_chunk_src, log->buffer + off, len);
+		if (len != end - start)
+			memcpy(logger_chunk_src + len, log->buffer,
+			       end - start - len);
+		smp_rmb();
+		if (logger_before(start, ACCESS_ONCE(log->head)))
+			continue;
+
+		t = ktime_get();
+		ret = lzo1x_1_compress(logger_chunk_src, end - start,
+				       logger_chunk_dst, &clen,
+				       logger_lzo_wrkmem);
+		ar->compress_ns += ktime_to_ns(ktime_sub(ktime_get(), t));
+		if (unlikely(ret != LZO_E_OK)) {
+			printk(KERN_ERR "logger: failed to compress "
+			       "log '%s': %d\n", log->misc.name, ret);
+			ar->skipped += end - start;
+			ar->end = end;
+			continue;
+		}
+
+		chunk = kmalloc(sizeof(*chunk) + clen, GFP_KERNEL);
+		if (!chunk)
+			break;
+		chunk->start = start;
+		chunk->len = end - start;
+		chunk->clen = clen;
+		memcpy(chunk->data, logger_chunk_dst, clen);
+		list_add_tail(&chunk->list, &ar->chunks);
+		ar->bytes += clen;
+		ar->in += chunk->len;
+		ar->out += clen;
+		ar->sealed++;
+		ar->end = end;
+
+		while (ar->bytes > logger_archive_size) {
+			chunk = list_first_entry(&ar->chunks,
+						 struct logger_chunk, list);
+			logger_drop_chunk(ar, chunk);
+			ar->dropped++;
+		}
+	}
+	mutex_unlock(&ar->mutex);
+}
+
+/*
+ * logger_archive_kick - called after each write to seal the next chunk once
+ * a full one has been committed
+ */
+static inline void logger_archive_kick(struct logger_log *log)
+{
+	/* no workqueue: setup failed and the archive stays empty */
+	if (logger_archive_wq &&
+	    ACCESS_ONCE(log->c_seq) - ACCESS_ONCE(log->archive.end) >=
+	    LOGGER_CHUNK_SIZE)
+		queue_work(logger_archive_wq, &log->archive.work);
+}
+
+/*
+ * logger_find_chunk - returns the chunk holding the entry at 'seq', if any
+ *
+ * The caller needs to hold log->archive.mutex.
+ */
+static struct logger_chunk *logger_find_chunk(struct logger_log *log,
+					      size_t seq)
+{
+	struct logger_chunk *chunk;
+
+	list_for_each_entry(chunk, &log->archive.chunks, list)
+		if (!logger_before(seq, chunk->start) &&
+		    logger_before(seq, chunk->start + chunk->len))
+			return chunk;
+	return NULL;
+}
+
+/*
+ * logger_archive_has - is the entry at 'seq' in the archive?
+ */
+static int logger_archive_has(struct logger_log *log, size_t seq)
+{
+	int ret;
+
+	mutex_lock(&log->archive.mutex);
+	ret = logger_find_chunk(log, seq) != NULL;
+	mutex_unlock(&log->archive.mutex);
+
+	return ret;
+}
+
+/*
+ * logger_archive_next - given 'seq', which is in neither the ring nor the
+ * archive any more, returns the oldest entry after it that still is: the
+ * start of the next chunk in the archive or the log head.
+ */
+static size_t logger_archive_next(struct logger_log *log, size_t seq)
+{
+	struct logger_chunk *chunk;
+	size_t head = ACCESS_ONCE(log->head);
+	size_t ret = head;
+
+	mutex_lock(&log->archive.mutex);
+	list_for_each_entry(chunk, &log->archive.chunks, list) {
+		if (logger_before(seq, chunk->start)) {
+			if (logger_before(chunk->start, head))
+				ret = chunk->start;
+			break;
+		}
+	}
+	mutex_unlock(&log->archive.mutex);
+
+	return ret;
+}
+
+/*
+ * logger_archive_oldest - where a new reader starts: the oldest archived
+ * entry, or the log head if that is older.
+ */
+static size_t logger_archive_oldest(struct logger_log *log)
+{
+	struct logger_chunk *chunk;
+	size_t ret = ACCESS_ONCE(log->head);
+
+	mutex_lock(&log->archive.mutex);
+	if (!list_empty(&log->archive.chunks)) {
+		chunk = list_first_entry(&log->archive.chunks,
+					 struct logger_chunk, list);
+		if (logger_before(chunk->start, ret))
+			ret = chunk->start;
+	}
+	mutex_unlock(&log->archive.mutex);
+
+	return ret;
+}
+
+/*
+ * logger_read_archive - copies the archived entry at the reader's position
+ * to the user-space buffer 'buf' and moves the reader past it. With a NULL
+ * 'buf' only returns the size of the entry. Returns -ENOENT if the entry is
+ * not (or no longer) in the archive; a chunk that fails to decompress is
+ * skipped the same way.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t logger_read_archive(struct logger_log *log,
+				   struct logger_reader *reader,
+				   char __user *buf, size_t count)
+{
+	struct logger_archive *ar = &log->archive;
+	struct logger_chunk *chunk;
+	size_t off, len;
+	ssize_t ret = 0;
+	ktime_t t;
+	__u16 val;
+
+	mutex_lock(&ar->mutex);
+	chunk = logger_find_chunk(log, reader->r_seq);
+	if (!chunk) {
+		ret = -ENOENT;
+	} else if (!reader->unpacked ||
+		   reader->unpacked_start != chunk->start) {
+		if (!reader->unpacked)
+			reader->unpacked = vmalloc(LOGGER_CHUNK_MAX);
+		if (!reader->unpacked) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		len = LOGGER_CHUNK_MAX;
+		t = ktime_get();
+		ret = lzo1x_decompress_safe(chunk->data, chunk->clen,
+					    reader->unpacked, &len);
+		ar->decompress_ns += ktime_to_ns(ktime_sub(ktime_get(), t));
+		ar->unpacked++;
+		if (ret != LZO_E_OK || len != chunk->len) {
+			printk(KERN_ERR "logger: failed to decompress "
+			       "log '%s': %d\n", log->misc.name, ret);
+			vfree(reader->unpacked);
+			reader->unpacked = NULL;
+			reader->r_seq = chunk->start + chunk->len;
+			ret = -ENOENT;
+			goto out;
+		}
+		reader->unpacked_start = chunk->start;
+	}
+out:
+	mutex_unlock(&ar->mutex);
+	if (ret)
+		return ret;
+
+	off = reader->r_seq - reader->unpacked_start;
+	memcpy(&val, reader->unpacked + off, sizeof(val));
+	ret = sizeof(struct logger_entry) + val;
+	if (!buf)
+		return ret;
+	if (count < ret)
+		return -EINVAL;
+	if (copy_to_user(buf, reader->unpacked + off, ret))
+		return -EFAULT;
+	reader->r_seq += ret;
+
+	return ret;
+}
+
+/*
+ * logger_archive_flush - throws the archive away along with the log
+ */
+static void logger_archive_flush(struct logger_log *log)
+{
+	struct logger_archive *ar = &log->archive;
+	struct logger_chunk *chunk, *tmp;
+
+	mutex_lock(&ar->mutex);
+	list_for_each_entry_safe(chunk, tmp, &ar->chunks, list)
+		logger_drop_chunk(ar, chunk);
+	ar->end = ACCESS_ONCE(log->head);
+	mutex_unlock(&ar->mutex);
+}
+
+static void logger_archive_release(struct logger_reader *reader)
+{
+	vfree(reader->unpacked);
+}
+
+static int logger_archive_show(struct seq_file *m, void *unused)
+{
+	struct logger_log *log = m->private;
+	struct logger_archive *ar = &log->archive;
+	unsigned int nr_chunks = 0;
+	struct logger_chunk *chunk;
+	size_t len = 0;
+
+	mutex_lock(&ar->mutex);
+	list_for_each_entry(chunk, &ar->chunks, list) {
+		nr_chunks++;
+		len += chunk->len;
+	}
+	seq_printf(m, "archive: %u chunks, %zu bytes in %zu\n",
+		   nr_chunks, len, ar->bytes);
+	seq_printf(m, "sealed: %lu chunks, %llu bytes in %llu (%llu%%)\n",
+		   ar->sealed, ar->in, ar->out,
+		   ar->in ? div64_u64(ar->out * 100, ar->in) : 0);
+	seq_printf(m, "dropped: %lu chunks, skipped: %llu bytes\n",
+		   ar->dropped, ar->skipped);
+	seq_printf(m, "compress: %llu us, decompress: %llu us in %lu chunks\n",
+		   div_u64(ar->compress_ns, NSEC_PER_USEC),
+		   div_u64(ar->decompress_ns, NSEC_PER_USEC), ar->unpacked);
+	mutex_unlock(&ar->mutex);
+
+	return 0;
+}
+
+static int logger_archive_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, logger_archive_show, inode->i_private);
+}
+
+static const struct file_operations logger_archive_fops = {
+	.owner = THIS_MODULE,
+	.open = logger_archive_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init logger_archive_init(struct logger_log *log)
+{
+	struct logger_archive *ar = &log->archive;
+
+	mutex_init(&ar->mutex);
+	INIT_LIST_HEAD(&ar->chunks);
+	INIT_WORK(&ar->work, logger_archive_work);
+	if (logger_debugfs_root)
+		ar->debugfs = debugfs_create_file(log->misc.name, S_IRUGO,
+						  logger_debugfs_root, log,
+						  &logger_archive_fops);
+	return 0;
+}
+
+static void __init logger_archive_exit(struct logger_log *log)
+{
+	debugfs_remove(log->archive.debugfs);
+	log->archive.debugfs = NULL;
+}
+
+/*
+ * logger_archive_setup - allocates what sealing chunks needs. If that fails
+ * the logs still work, they just don't keep an archive.
+ */
+static int __init logger_archive_setup(void)
+{
+	logger_chunk_src = vmalloc(LOGGER_CHUNK_MAX);
+	logger_chunk_dst = vmalloc(lzo1x_worst_compress(LOGGER_CHUNK_MAX));
+	logger_lzo_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	logger_archive_wq = create_singlethread_workqueue("logger");
+	if (!logger_chunk_src || !logger_chunk_dst || !logger_lzo_wrkmem ||
+	    !logger_archive_wq) {
+		printk(KERN_ERR "logger: failed to set up compression, "
+		       "running without an archive\n");
+		if (logger_archive_wq)
+			destroy_workqueue(logger_archive_wq);
+		logger_archive_wq = NULL;
+		vfree(logger_lzo_wrkmem);
+		vfree(logger_chunk_dst);
+		vfree(logger_chunk_src);
+		logger_lzo_wrkmem = NULL;
+		logger_chunk_dst = NULL;
+		logger_chunk_src = NULL;
+		return 0;
+	}
+	logger_debugfs_root = debugfs_create_dir("logger", NULL);
+	return 0;
+}
+
+#else
+
+static inline void logger_archive_kick(struct logger_log *log)
+{
+}
+
+static inline int logger_archive_has(struct logger_log *log, size_t seq)
+{
+	return 0;
+}
+
+static inline size_t logger_archive_next(struct logger_log *log, size_t seq)
+{
+	return ACCESS_ONCE(log->head);
+}
+
+static inline size_t logger_archive_oldest(struct logger_log *log)
+{
+	return ACCESS_ONCE(log->head);
+}
+
+static inline ssize_t logger_read_archive(struct logger_log *log,
+					  struct logger_reader *reader,
+					  char __user *buf, size_t count)
+{
+	return -ENOENT;
+}
+
+static inline void logger_archive_flush(struct logger_log *log)
+{
+}
+
+static inline void logger_archive_release(struct logger_reader *reader)
+{
+}
+
+static inline int logger_archive_init(struct logger_log *log)
+{
+	return 0;
+}
+
+static inline void logger_archive_exit(struct logger_log *log)
+{
+}
+
+static inline int logger_archive_setup(void)
+{
+	return 0;
+}
+
+#endif /* CONFIG_ANDROID_LOGGER_COMPRESS */
+
+/*
+ * logger_catch_up - moves a lapped reader forward to the oldest entry it can
+ * still read. Returns 1 if that entry is in the archive, 0 if it is in the
+ * ring (or the reader is at the end of the log).
+ *
+ * Caller must hold reader->mutex.
+ */
+static int logger_catch_up(struct logger_log *log, struct logger_reader *reader)
+{
+	while (logger_lapped(log, reader)) {
+		if (logger_archive_has(log, reader->r_seq))
+			return 1;
+		reader->r_seq = logger_archive_next(log, reader->r_seq);
+	}
+	return 0;
+}
+
+/*
+ * do_read_entry - copies the next entry to the user-space buffer 'buf' if it
+ * fits in 'count' bytes and moves the reader past it. Returns the size of the
+ * entry, 0 if there is nothing to read and -EINVAL if it does not fit.
+ *
+ * Writers may overwrite the entry while it is being copied out. In that case
+ * the copy is thrown away and the reader retries from the oldest entry left,
+ * just as if it had been pulled forward before the write. That may be a
+ * copy of the same entry in the archive.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t do_read_entry(struct logger_log *log,
+			     struct logger_reader *reader,
+			     char __user *buf, size_t count)
+{
+	ssize_t ret;
+
+retry:
+	if (logger_catch_up(log, reader)) {
+		ret = logger_read_archive(log, reader, buf, count);
+		if (ret == -ENOENT)
+			goto retry;
+		return ret;
+	}
+	if (!logger_readable(log, reader))
+		return 0;
+
+	/* get the size of the next entry */
+	ret = get_entry_len(log, logger_offset(reader->r_seq));
+	if (logger_lapped(log, reader))
+		goto retry;
+	if (count < ret)
+		return -EINVAL;
+
+	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (ret < 0)
+		return ret;
+	if (logger_lapped(log, reader))
+		goto retry;
+	reader->r_seq += ret;
+
+	return ret;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -149,7 +750,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in batch mode (see
+ * 	  LOGGER_SET_BATCH_READ) as many whole entries as fit in the buffer
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -160,15 +762,16 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
+	size_t done;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		mutex_lock(&reader->mutex);
+		ret = !logger_readable(log, reader);
+		mutex_unlock(&reader->mutex);
 		if (!ret)
 			break;
 
@@ -189,131 +792,153 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+
+	ret = do_read_entry(log, reader, buf, count);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(!ret)) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+	/*
+	 * In batch mode keep going while whole entries fit, but never block
+	 * once we have something to return.
+	 */
+	if (ret > 0 && reader->batch) {
+		done = ret;
+		while (done < count) {
+			ret = do_read_entry(log, reader, buf + done,
+					    count - done);
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		ret = done;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * get_next_entry - return the sequence number of the first valid entry at
+ * least 'len' bytes after 'seq'.
  *
- * Caller must hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static size_t get_next_entry(struct logger_log *log, size_t seq, size_t len)
 {
 	size_t count = 0;
 
 	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
+		size_t nr = get_entry_len(log, logger_offset(seq));
+		seq += nr;
 		count += nr;
 	} while (count < len);
 
-	return off;
-}
-
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
-
-	return 0;
+	return seq;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at sequence number
+ * 'seq', which the caller has reserved.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void do_write_log(struct logger_log *log, size_t seq,
+			 const void *buf, size_t count)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t off = logger_offset(seq);
+	size_t len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_commit - appends the 'count' byte entry in 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * Space is reserved under log->lock, which first pulls the start head forward
+ * to the first entry after (what will be) the new write head. The entry is
+ * then copied in without the lock and published once every earlier
+ * reservation has been. Callers run with preemption disabled so nobody spins
+ * on a writer that got scheduled out.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void logger_commit(struct logger_log *log, const void *buf,
+			  size_t count)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+	size_t start, end;
 
-	log->w_off = logger_offset(log->w_off + count);
+	spin_lock(&log->lock);
+	start = log->w_seq;
+	end = start + count;
 
+	/*
+	 * A writer a whole lap behind could still be copying into the space
+	 * we are about to reuse. That is all but impossible with entries this
+	 * much smaller than the log, but wait for it if it happens.
+	 */
+	while (logger_before(ACCESS_ONCE(log->c_seq) + log->size, end))
+		cpu_relax();
+	smp_rmb();
+
+	if (logger_before(log->head + log->size, end)) {
+		log->head = get_next_entry(log, log->head,
+					   end - log->size - log->head);
+		log->ctl->head = log->head;
+	}
+	log->w_seq = end;
+	spin_unlock(&log->lock);
+
+	/* readers must see the new head before the old entries go away */
+	smp_wmb();
+	do_write_log(log, start, buf, count);
+
+	while (ACCESS_ONCE(log->c_seq) != start)
+		cpu_relax();
+	smp_mb();
+	log->ctl->tail = end;
+	smp_wmb();
+	log->c_seq = end;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_stage_from_user - copies the payload from the user-space vectors 'iov'
+ * to 'buf'. With 'atomic' set the copy must not fault and fails instead.
  *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * Returns the number of bytes copied on success, negative error code on
+ * failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static ssize_t do_stage_from_user(unsigned char *buf, const struct iovec *iov,
+				  unsigned long nr_segs, size_t count,
+				  int atomic)
 {
-	size_t len;
+	ssize_t ret = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0) {
+		size_t len;
+		unsigned long left;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count - ret);
+
+		if (atomic)
+			left = __copy_from_user_inatomic(buf + ret,
+							 iov->iov_base, len);
+		else
+			left = copy_from_user(buf + ret, iov->iov_base, len);
+		if (unlikely(left))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		iov++;
+		ret += len;
+	}
 
-	return count;
+	return ret;
 }
 
 /*
@@ -325,10 +950,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
+	struct logger_stage *stage;
+	unsigned char *buf;
 	struct timespec now;
-	ssize_t ret = 0;
+	ssize_t ret;
 
 	now = current_kernel_time();
 
@@ -342,39 +968,46 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Assemble the entry in this cpu's staging buffer, so the log itself
+	 * is only touched for a plain memcpy. If the payload is not paged in
+	 * we fall back to a private buffer that the copy is allowed to fault
+	 * on. Either way nothing is written to the log unless the whole entry
+	 * could be copied.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	stage = get_cpu_ptr(logger_stage);
+	memcpy(stage->buf, &header, sizeof(struct logger_entry));
+	pagefault_disable();
+	ret = do_stage_from_user(stage->buf + sizeof(struct logger_entry),
+				 iov, nr_segs, header.len, 1);
+	pagefault_enable();
+	if (likely(ret >= 0)) {
+		logger_commit(log, stage->buf,
+			      sizeof(struct logger_entry) + header.len);
+		put_cpu_ptr(logger_stage);
+		logger_archive_kick(log);
+	} else {
+		put_cpu_ptr(logger_stage);
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		buf = kmalloc(sizeof(struct logger_entry) + header.len,
+			      GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		memcpy(buf, &header, sizeof(struct logger_entry));
+		ret = do_stage_from_user(buf + sizeof(struct logger_entry),
+					 iov, nr_segs, header.len, 0);
+		if (likely(ret >= 0)) {
+			preempt_disable();
+			logger_commit(log, buf,
+				      sizeof(struct logger_entry) + header.len);
+			preempt_enable();
 		}
-
-		iov++;
-		ret += nr;
+		kfree(buf);
+		if (unlikely(ret < 0))
+			return ret;
+		logger_archive_kick(log);
 	}
 
-	mutex_unlock(&log->mutex);
-
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
@@ -409,12 +1042,12 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_seq = logger_archive_oldest(log);
+		reader->batch = 0;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->unpacked = NULL;
+#endif
 
 		file->private_data = reader;
 	} else
@@ -432,7 +1065,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
+		logger_archive_release(reader);
 		kfree(reader);
 	}
 
@@ -462,22 +1095,40 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (logger_readable(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the control page and the ring behind it read-only. Readers of the
+ * mapping follow the protocol described with struct logger_mmap_header.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, log->ctl, 0);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -488,10 +1139,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		logger_catch_up(log, reader);
+		ret = ACCESS_ONCE(log->c_seq) - reader->r_seq;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,25 +1150,53 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		mutex_lock(&reader->mutex);
+		while (1) {
+			if (logger_catch_up(log, reader)) {
+				ret = logger_read_archive(log, reader, NULL, 0);
+				if (ret == -ENOENT)
+					continue;
+				break;
+			}
+			if (logger_readable(log, reader))
+				ret = get_entry_len(log,
+						logger_offset(reader->r_seq));
+			else
+				ret = 0;
+			if (!logger_lapped(log, reader))
+				break;
+		}
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		reader->batch = !!arg;
+		mutex_unlock(&reader->mutex);
+		ret = 0;
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/*
+		 * Every reader is behind the new head now and gets pulled
+		 * forward to it on its next access.
+		 */
+		spin_lock(&log->lock);
+		log->head = log->c_seq;
+		log->ctl->head = log->head;
+		spin_unlock(&log->lock);
+		logger_archive_flush(log);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -526,6 +1205,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -534,13 +1214,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, a multiple of PAGE_SIZE, greater than
+ * LOGGER_ENTRY_MAX_LEN, and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * The buffer is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,9 +1227,9 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.w_seq = 0, \
+	.c_seq = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -577,10 +1256,27 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->ctl = vmalloc_user(PAGE_SIZE + log->size);
+	if (unlikely(!log->ctl)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+	log->ctl->size = log->size;
+	log->buffer = (unsigned char *)log->ctl + PAGE_SIZE;
+
+	ret = logger_archive_init(log);
+	if (unlikely(ret)) {
+		vfree(log->ctl);
+		return ret;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		logger_archive_exit(log);
+		vfree(log->ctl);
 		return ret;
 	}
 
@@ -594,6 +1290,16 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	logger_stage = alloc_percpu(struct logger_stage);
+	if (unlikely(!logger_stage)) {
+		printk(KERN_ERR "logger: failed to allocate staging buffers\n");
+		return -ENOMEM;
+	}
+
+	ret = logger_archive_setup();
+	if (unlikely(ret))
+		goto out;
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
@@ -30,6 +30,23 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - the first page of a mapped log
+ *
+ * The log itself follows at offset PAGE_SIZE. 'head' and 'tail' are byte
+ * sequence numbers; the entry at sequence number n starts at offset
+ * (n & (size - 1)) into the log and entries may wrap around its end. Entries
+ * in [head, tail) are complete. To drain the log, read 'tail', issue a read
+ * barrier, copy entries out, issue another read barrier and re-read 'head':
+ * if it moved past the position the copy started at, the copy may have been
+ * overwritten and has to be restarted from 'head'.
+ */
+struct logger_mmap_header {
+	__u32		size;	/* size of the log in bytes */
+	__u32		head;	/* oldest entry in the log */
+	__u32		tail;	/* end of the newest complete entry */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +62,6 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* multi-entry read */
 
 #endif /* _LINUX_LOGGER_H */
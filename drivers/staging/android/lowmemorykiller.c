@@ -12,6 +12,9 @@
  * and kill processes with a oom_adj value of 0 or higher when the free memory
  * drops below 1024 pages.
  *
+ * The most recent kills, and how long each victim took to be freed, can be
+ * read from /sys/module/lowmemorykiller/parameters/kill_log.
+ *
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
@@ -35,6 +38,8 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -54,6 +59,40 @@ static int lowmem_minfree_size = 4;
 
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
+static ktime_t lowmem_deathpending_start;
+
+/*
+ * Processes are kept on one list per oom_adj value, updated whenever a
+ * process is created, changes its oom_adj or is freed.  Picking a victim
+ * then only has to look at the highest populated bucket instead of
+ * walking every task in the system under tasklist_lock.
+ */
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define lowmem_bucket(adj)	(&lowmem_index[(adj) - OOM_DISABLE])
+
+static DEFINE_SPINLOCK(lowmem_lock);
+static struct list_head lowmem_index[LOWMEM_BUCKETS];
+static unsigned int lowmem_index_gen;	/* bumped on every index change */
+
+#define LOWMEM_KILL_LOG_SIZE	32
+
+struct lowmem_kill_entry {
+	unsigned long	time;
+	pid_t		pid;
+	char		comm[TASK_COMM_LEN];
+	int		oom_adj;
+	int		tasksize;
+	int		min_adj;
+	int		other_free;
+	int		other_file;
+	s64		reap_us;
+};
+
+static struct lowmem_kill_entry lowmem_kill_log[LOWMEM_KILL_LOG_SIZE];
+static unsigned int lowmem_kill_count;
+
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -72,23 +111,164 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	unsigned long flags;
+	s64 reap_us;
 
-	if (task == lowmem_deathpending)
+	spin_lock_irqsave(&lowmem_lock, flags);
+	list_del_init(&task->lmk_node);
+	lowmem_index_gen++;
+	if (task == lowmem_deathpending) {
 		lowmem_deathpending = NULL;
+		reap_us = ktime_us_delta(ktime_get(), lowmem_deathpending_start);
+		lowmem_kill_log[(lowmem_kill_count - 1) %
+				LOWMEM_KILL_LOG_SIZE].reap_us = reap_us;
+		trace_lowmem_reaped(task, reap_us);
+	}
+	spin_unlock_irqrestore(&lowmem_lock, flags);
 
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+static void lowmem_index_task(struct task_struct *p)
+{
+	unsigned long flags;
+
+	p = p->group_leader;
+	if (p->flags & PF_KTHREAD)
+		return;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	list_move_tail(&p->lmk_node, lowmem_bucket(p->signal->oom_adj));
+	lowmem_index_gen++;
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
+	lowmem_index_task(data);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * Returns the largest process in the highest populated oom_adj bucket at
+ * or above min_adj, with a reference held.  RSS changes without any
+ * notification, so it is sampled here rather than kept sorted.
+ *
+ * lowmem_lock is taken when a task is freed, which can happen from
+ * softirq, so task_lock() must not nest inside it: candidates are pinned
+ * a batch at a time under lowmem_lock and sampled after dropping it.
+ * Tasks only leave the index once their last reference is gone, so a
+ * task whose count already dropped to zero is skipped rather than pinned.
+ * If the index changed between two batches, the bucket is walked again
+ * from the start; the tasks seen so far are just compared once more.
+ */
+#define LOWMEM_SCAN_BATCH	16
+
+static struct task_struct *
+lowmem_select(int min_adj, int *selected_oom_adj, int *selected_tasksize)
+{
+	struct task_struct *batch[LOWMEM_SCAN_BATCH];
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	unsigned long flags;
+	unsigned int gen;
 	int tasksize;
+	int oom_adj;
+	int skip, more;
+	int i, n;
+
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj && !selected;
+	     oom_adj--) {
+		skip = 0;
+		do {
+			n = 0;
+			i = 0;
+			more = 0;
+			spin_lock_irqsave(&lowmem_lock, flags);
+			if (skip && gen != lowmem_index_gen)
+				skip = 0;
+			gen = lowmem_index_gen;
+			list_for_each_entry(p, lowmem_bucket(oom_adj),
+					    lmk_node) {
+				if (i++ < skip)
+					continue;
+				if (n == LOWMEM_SCAN_BATCH) {
+					more = 1;
+					break;
+				}
+				/* being freed, on its way out of the index */
+				if (!atomic_inc_not_zero(&p->usage))
+					continue;
+				batch[n++] = p;
+			}
+			spin_unlock_irqrestore(&lowmem_lock, flags);
+			skip = i - more;
+
+			for (i = 0; i < n; i++) {
+				p = batch[i];
+				task_lock(p);
+				tasksize = p->mm ? get_mm_rss(p->mm) : 0;
+				task_unlock(p);
+				if (tasksize <= 0 ||
+				    (selected && tasksize <= *selected_tasksize)) {
+					put_task_struct(p);
+					continue;
+				}
+				if (selected)
+					put_task_struct(selected);
+				selected = p;
+				*selected_tasksize = tasksize;
+				*selected_oom_adj = oom_adj;
+				lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+					     p->pid, p->comm, oom_adj, tasksize);
+			}
+		} while (more);
+	}
+
+	return selected;
+}
+
+static void lowmem_record_kill(struct task_struct *p, int oom_adj,
+			       int tasksize, int min_adj,
+			       int other_free, int other_file)
+{
+	struct lowmem_kill_entry *e;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	e = &lowmem_kill_log[lowmem_kill_count++ % LOWMEM_KILL_LOG_SIZE];
+	e->time = jiffies;
+	e->pid = p->pid;
+	memcpy(e->comm, p->comm, TASK_COMM_LEN);
+	e->oom_adj = oom_adj;
+	e->tasksize = tasksize;
+	e->min_adj = min_adj;
+	e->other_free = other_free;
+	e->other_file = other_file;
+	e->reap_us = -1;
+
+	lowmem_deathpending = p;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	lowmem_deathpending_start = ktime_get();
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+}
+
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int selected_oom_adj = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -129,58 +309,67 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
+	selected = lowmem_select(min_adj, &selected_oom_adj,
+				 &selected_tasksize);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		trace_lowmem_kill(selected, selected_oom_adj,
+				  selected_tasksize, min_adj,
+				  other_free, other_file);
+		lowmem_record_kill(selected, selected_oom_adj,
+				   selected_tasksize, min_adj,
+				   other_free, other_file);
+		send_sig(SIGKILL, selected, 1);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+static int lowmem_kill_log_set(const char *val, const struct kernel_param *kp)
+{
+	return -EPERM;
+}
+
+/*
+ * One line per recent kill, oldest first:
+ * <msecs> <pid> <comm> <adj> <size> <min_adj> <free> <file> <reap_us>
+ * reap_us is -1 while the victim has not been freed yet.
+ */
+static int lowmem_kill_log_get(char *buffer, const struct kernel_param *kp)
+{
+	struct lowmem_kill_entry *e;
+	unsigned long flags;
+	unsigned int i;
+	int len = 0;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	i = lowmem_kill_count > LOWMEM_KILL_LOG_SIZE ?
+		lowmem_kill_count - LOWMEM_KILL_LOG_SIZE : 0;
+	for (; i != lowmem_kill_count; i++) {
+		e = &lowmem_kill_log[i % LOWMEM_KILL_LOG_SIZE];
+		len += scnprintf(buffer + len, PAGE_SIZE - len,
+				 "%u %d %s %d %d %d %d %d %lld\n",
+				 jiffies_to_msecs(e->time - INITIAL_JIFFIES),
+				 e->pid, e->comm, e->oom_adj, e->tasksize,
+				 e->min_adj, e->other_free, e->other_file,
+				 e->reap_us);
+	}
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+
+	return len;
+}
+
+static struct kernel_param_ops lowmem_kill_log_ops = {
+	.set = lowmem_kill_log_set,
+	.get = lowmem_kill_log_get,
+};
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -188,7 +377,20 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_index[i]);
+
 	task_free_register(&task_nb);
+	task_oom_adj_register(&oom_adj_nb);
+
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_index_task(p);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -196,6 +398,7 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	task_oom_adj_unregister(&oom_adj_nb);
 	task_free_unregister(&task_nb);
 }
 
@@ -205,6 +408,7 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_cb(kill_log, &lowmem_kill_log_ops, NULL, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
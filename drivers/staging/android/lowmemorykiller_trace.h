@@ -0,0 +1,75 @@
+/* drivers/staging/android/lowmemorykiller_trace.h
+ *
+ * Tracepoints for low memory killer kills.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_kill,
+	TP_PROTO(struct task_struct *p, int oom_adj, int tasksize,
+		 int min_adj, int other_free, int other_file),
+	TP_ARGS(p, oom_adj, tasksize, min_adj, other_free, other_file),
+	TP_STRUCT__entry(
+		__array(char, comm, TASK_COMM_LEN)
+		__field(pid_t, pid)
+		__field(int, oom_adj)
+		__field(int, tasksize)
+		__field(int, min_adj)
+		__field(int, other_free)
+		__field(int, other_file)
+	),
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid = p->pid;
+		__entry->oom_adj = oom_adj;
+		__entry->tasksize = tasksize;
+		__entry->min_adj = min_adj;
+		__entry->other_free = other_free;
+		__entry->other_file = other_file;
+	),
+	TP_printk("pid=%d comm=%s adj=%d size=%d min_adj=%d free=%d file=%d",
+		  __entry->pid, __entry->comm, __entry->oom_adj,
+		  __entry->tasksize, __entry->min_adj,
+		  __entry->other_free, __entry->other_file)
+);
+
+TRACE_EVENT(lowmem_reaped,
+	TP_PROTO(struct task_struct *p, s64 latency_us),
+	TP_ARGS(p, latency_us),
+	TP_STRUCT__entry(
+		__array(char, comm, TASK_COMM_LEN)
+		__field(pid_t, pid)
+		__field(s64, latency_us)
+	),
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid = p->pid;
+		__entry->latency_us = latency_us;
+	),
+	TP_printk("pid=%d comm=%s latency=%lldus",
+		  __entry->pid, __entry->comm, __entry->latency_us)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH ../../drivers/staging/android
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
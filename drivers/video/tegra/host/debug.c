@@ -166,6 +166,7 @@ int nvhost_channel_fifo_debug(struct nvhost_dev *m)
 
 	for (i = 0; i < NVHOST_NUMCHANNELS; i++) {
 		void __iomem *regs = m->channels[i].aperture;
+		struct nvhost_cdma *cdma = &m->channels[i].cdma;
 		u32 dmaput, dmaget, dmactrl;
 		u32 cbstat, cbread;
 		u32 fifostat;
@@ -209,6 +210,13 @@ int nvhost_channel_fifo_debug(struct nvhost_dev *m)
 			break;
 		}
 
+		printk("%d: queued %u (max %u), stalls %u (%lluus), "
+			   "pushbuffer %u slots, sync queue %u words\n", i,
+			   cdma->stats.depth, cdma->stats.max_depth,
+			   cdma->stats.stalls,
+			   (unsigned long long)cdma->stats.stall_us,
+			   cdma->push_buffer.size / 8, cdma->sync_queue.size);
+
 		nvhost_cdma_find_gather(&m->channels[i].cdma, dmaget, &phys_addr, &size);
 
 		/* If dmaget is in the pushbuffer (should always be?),
@@ -22,16 +22,10 @@
 
 #include "nvhost_cdma.h"
 #include "nvhost_dev.h"
+#include <linux/slab.h>
+#include <linux/ktime.h>
 #include <asm/cacheflush.h>
 
-/*
- * TODO:
- *   stats
- *     - for figuring out what to optimize further
- *   resizable push buffer & sync queue
- *     - some channels hardly need any, some channels (3d) could use more
- */
-
 #define cdma_to_channel(cdma) container_of(cdma, struct nvhost_channel, cdma)
 #define cdma_to_dev(cdma) ((cdma_to_channel(cdma))->dev)
 
@@ -45,6 +39,7 @@
 
 // 8 bytes per slot. (This number does not include the final RESTART.)
 #define PUSH_BUFFER_SIZE (NVHOST_GATHER_QUEUE_SIZE * 8)
+#define PUSH_BUFFER_MAX_SIZE (NVHOST_GATHER_QUEUE_MAX_SIZE * 8)
 
 static void destroy_push_buffer(struct push_buffer *pb);
 
@@ -53,22 +48,23 @@ static void destroy_push_buffer(struct push_buffer *pb);
  */
 static void reset_push_buffer(struct push_buffer *pb)
 {
-	pb->fence = PUSH_BUFFER_SIZE - 8;
+	pb->fence = pb->size - 8;
 	pb->cur = 0;
 }
 
 /**
  * Init push buffer resources
  */
-static int init_push_buffer(struct push_buffer *pb)
+static int init_push_buffer(struct push_buffer *pb, u32 size)
 {
 	pb->mem = NULL;
 	pb->mapped = NULL;
 	pb->phys = 0;
+	pb->size = size;
 	reset_push_buffer(pb);
 
 	/* allocate and map pushbuffer memory */
-	pb->mem = nvmap_alloc(PUSH_BUFFER_SIZE + 4, 32,
+	pb->mem = nvmap_alloc(pb->size + 4, 32,
 			NVMEM_HANDLE_WRITE_COMBINE, (void**)&pb->mapped);
 	if (IS_ERR_OR_NULL(pb->mem)) {
 		pb->mem = NULL;
@@ -79,7 +75,7 @@ static int init_push_buffer(struct push_buffer *pb)
 	pb->phys = nvmap_pin_single(pb->mem);
 
 	/* put the restart at the end of pushbuffer memory */
-	*(pb->mapped + (PUSH_BUFFER_SIZE >> 2)) = nvhost_opcode_restart(pb->phys);
+	*(pb->mapped + (pb->size >> 2)) = nvhost_opcode_restart(pb->phys);
 
 	return 0;
 
@@ -116,7 +112,7 @@ static void push_to_push_buffer(struct push_buffer *pb, u32 op1, u32 op2)
 	BUG_ON(cur == pb->fence);
 	*(p++) = op1;
 	*(p++) = op2;
-	pb->cur = (cur + 8) & (PUSH_BUFFER_SIZE - 1);
+	pb->cur = (cur + 8) & (pb->size - 1);
 	/* printk("push_to_push_buffer: op1=%08x; op2=%08x; cur=%x\n", op1, op2, pb->cur); */
 }
 
@@ -126,7 +122,7 @@ static void push_to_push_buffer(struct push_buffer *pb, u32 op1, u32 op2)
  */
 static void pop_from_push_buffer(struct push_buffer *pb, unsigned int slots)
 {
-	pb->fence = (pb->fence + slots * 8) & (PUSH_BUFFER_SIZE - 1);
+	pb->fence = (pb->fence + slots * 8) & (pb->size - 1);
 }
 
 /**
@@ -134,7 +130,7 @@ static void pop_from_push_buffer(struct push_buffer *pb, unsigned int slots)
  */
 static u32 push_buffer_space(struct push_buffer *pb)
 {
-	return ((pb->fence - pb->cur) & (PUSH_BUFFER_SIZE - 1)) / 8;
+	return ((pb->fence - pb->cur) & (pb->size - 1)) / 8;
 }
 
 static u32 push_buffer_putptr(struct push_buffer *pb)
@@ -186,8 +182,8 @@ static unsigned int sync_queue_space(struct sync_queue *queue)
 	unsigned int write = queue->write;
 	u32 size;
 
-	BUG_ON(read  > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
-	BUG_ON(write > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(read  > (queue->size - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(write > (queue->size - SYNC_QUEUE_MIN_ENTRY));
 
 	/*
 	 * We can use all of the space up to the end of the buffer, unless the
@@ -197,7 +193,7 @@ static unsigned int sync_queue_space(struct sync_queue *queue)
 	if (read > write) {
 		size = (read - 1) - write;
 	} else {
-		size = NVHOST_SYNC_QUEUE_SIZE - write;
+		size = queue->size - write;
 
 		/*
 		 * If the read position is zero, it gets complicated. We can't
@@ -238,7 +234,7 @@ static void add_to_sync_queue(struct sync_queue *queue,
 	BUG_ON(sync_queue_space(queue) < nr_handles);
 
 	write += size;
-	BUG_ON(write > NVHOST_SYNC_QUEUE_SIZE);
+	BUG_ON(write > queue->size);
 
 	*p++ = sync_point_id;
 	*p++ = sync_point_value;
@@ -248,7 +244,7 @@ static void add_to_sync_queue(struct sync_queue *queue,
 		memcpy(p, handles, nr_handles*sizeof(struct nvmap_handle *));
 
 	/* If there's not enough room for another entry, wrap to the start. */
-	if ((write + SYNC_QUEUE_MIN_ENTRY) > NVHOST_SYNC_QUEUE_SIZE) {
+	if ((write + SYNC_QUEUE_MIN_ENTRY) > queue->size) {
 		/*
 		 * It's an error for the read position to be zero, as that
 		 * would mean we emptied the queue while adding something.
@@ -269,8 +265,8 @@ static u32 *sync_queue_head(struct sync_queue *queue)
 	u32 read = queue->read;
 	u32 write = queue->write;
 
-	BUG_ON(read  > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
-	BUG_ON(write > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(read  > (queue->size - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(write > (queue->size - SYNC_QUEUE_MIN_ENTRY));
 
 	if (read == write)
 		return NULL;
@@ -291,10 +287,10 @@ dequeue_sync_queue_head(struct sync_queue *queue)
 	size = 4 + queue->buffer[read + 3];
 
 	read += size;
-	BUG_ON(read > NVHOST_SYNC_QUEUE_SIZE);
+	BUG_ON(read > queue->size);
 
 	/* If there's not enough room for another entry, wrap to the start. */
-	if ((read + SYNC_QUEUE_MIN_ENTRY) > NVHOST_SYNC_QUEUE_SIZE)
+	if ((read + SYNC_QUEUE_MIN_ENTRY) > queue->size)
 		read = 0;
 
 	queue->read = read;
@@ -334,6 +330,56 @@ static void start_cdma(struct nvhost_cdma *cdma)
 	cdma->running = true;
 }
 
+/**
+ * Stop channel DMA. The sync queue must be empty.
+ */
+static void stop_cdma(struct nvhost_cdma *cdma)
+{
+	void __iomem *chan_regs = cdma_to_channel(cdma)->aperture;
+
+	if (!cdma->running)
+		return;
+
+	writel(nvhost_channel_dmactrl(true, false, false),
+		chan_regs + HOST1X_CHANNEL_DMACTRL);
+	cdma->running = false;
+}
+
+/**
+ * Double the push buffer and/or sync queue if a submit had to wait for
+ * space in them. The sync queue must be empty, so that nothing in either
+ * is still in use by command DMA; if memory can't be found, the old ones
+ * are kept.
+ * Must be called with the cdma lock held.
+ */
+static void resize_cdma(struct nvhost_cdma *cdma)
+{
+	BUG_ON(sync_queue_head(&cdma->sync_queue));
+
+	if (cdma->grow_sync_queue) {
+		struct sync_queue *queue = &cdma->sync_queue;
+		u32 *buffer = kmalloc(queue->size * 2 * sizeof(u32),
+				GFP_KERNEL);
+		if (buffer) {
+			kfree(queue->buffer);
+			queue->buffer = buffer;
+			queue->size *= 2;
+			reset_sync_queue(queue);
+		}
+		cdma->grow_sync_queue = false;
+	}
+
+	if (cdma->grow_push_buffer) {
+		struct push_buffer pb;
+		if (!init_push_buffer(&pb, cdma->push_buffer.size * 2)) {
+			stop_cdma(cdma);
+			destroy_push_buffer(&cdma->push_buffer);
+			cdma->push_buffer = pb;
+		}
+		cdma->grow_push_buffer = false;
+	}
+}
+
 /**
  * Kick channel DMA into action by writing its PUT offset (if it has changed)
  */
@@ -382,15 +428,28 @@ static unsigned int wait_cdma(struct nvhost_cdma *cdma, enum cdma_event event)
 {
 	for (;;) {
 		unsigned int space = cdma_status(cdma, event);
+		ktime_t start;
+
 		if (space)
 			return space;
 
+		/* out of room: grow at the next idle point */
+		if (event == CDMA_EVENT_PUSH_BUFFER_SPACE &&
+		    cdma->push_buffer.size < PUSH_BUFFER_MAX_SIZE)
+			cdma->grow_push_buffer = true;
+		else if (event == CDMA_EVENT_SYNC_QUEUE_SPACE &&
+		    cdma->sync_queue.size < NVHOST_SYNC_QUEUE_MAX_SIZE)
+			cdma->grow_sync_queue = true;
+
 		BUG_ON(cdma->event != CDMA_EVENT_NONE);
 		cdma->event = event;
 
+		start = ktime_get();
 		mutex_unlock(&cdma->lock);
 		down(&cdma->sem);
 		mutex_lock(&cdma->lock);
+		cdma->stats.stalls++;
+		cdma->stats.stall_us += ktime_to_us(ktime_sub(ktime_get(), start));
 	}
 }
 
@@ -409,7 +468,9 @@ static void update_cdma(struct nvhost_cdma *cdma)
 	bool signal = false;
 	struct nvhost_dev *dev = cdma_to_dev(cdma);
 
-	BUG_ON(!cdma->running);
+	/* stopped with an empty sync queue; a late update has nothing to do */
+	if (!cdma->running)
+		return;
 
 	/*
 	 * Walk the sync queue, reading the sync point registers as necessary,
@@ -453,6 +514,7 @@ static void update_cdma(struct nvhost_cdma *cdma)
 		}
 
 		dequeue_sync_queue_head(&cdma->sync_queue);
+		cdma->stats.depth--;
 		if (cdma->event == CDMA_EVENT_SYNC_QUEUE_SPACE)
 			signal = true;
 	}
@@ -464,6 +526,21 @@ static void update_cdma(struct nvhost_cdma *cdma)
 	}
 }
 
+static void update_cdma_work(struct work_struct *work)
+{
+	struct nvhost_cdma *cdma =
+		container_of(work, struct nvhost_cdma, update);
+	int nr_completed;
+
+	nvhost_cdma_update(cdma);
+
+	/* only let the module idle once its submits have been retired */
+	nr_completed = atomic_xchg(&cdma->nr_completed, 0);
+	if (nr_completed)
+		nvhost_module_idle_mult(&cdma_to_channel(cdma)->mod,
+					nr_completed);
+}
+
 /**
  * Create a cdma
  */
@@ -473,12 +550,27 @@ int nvhost_cdma_init(struct nvhost_cdma *cdma)
 
 	mutex_init(&cdma->lock);
 	sema_init(&cdma->sem, 0);
+	INIT_WORK(&cdma->update, update_cdma_work);
+	atomic_set(&cdma->nr_completed, 0);
 	cdma->event = CDMA_EVENT_NONE;
 	cdma->running = false;
-	err = init_push_buffer(&cdma->push_buffer);
-	if (err)
-		return err;
+	cdma->grow_push_buffer = false;
+	cdma->grow_sync_queue = false;
+	memset(&cdma->stats, 0, sizeof(cdma->stats));
+
+	cdma->sync_queue.size = NVHOST_SYNC_QUEUE_SIZE;
+	cdma->sync_queue.buffer = kmalloc(NVHOST_SYNC_QUEUE_SIZE * sizeof(u32),
+					GFP_KERNEL);
+	if (!cdma->sync_queue.buffer)
+		return -ENOMEM;
 	reset_sync_queue(&cdma->sync_queue);
+
+	err = init_push_buffer(&cdma->push_buffer, PUSH_BUFFER_SIZE);
+	if (err) {
+		kfree(cdma->sync_queue.buffer);
+		cdma->sync_queue.buffer = NULL;
+		return err;
+	}
 	return 0;
 }
 
@@ -488,19 +580,18 @@ int nvhost_cdma_init(struct nvhost_cdma *cdma)
 void nvhost_cdma_deinit(struct nvhost_cdma *cdma)
 {
 	BUG_ON(cdma->running);
+	cancel_work_sync(&cdma->update);
 	destroy_push_buffer(&cdma->push_buffer);
+	kfree(cdma->sync_queue.buffer);
+	cdma->sync_queue.buffer = NULL;
 }
 
 void nvhost_cdma_stop(struct nvhost_cdma *cdma)
 {
-	void __iomem *chan_regs = cdma_to_channel(cdma)->aperture;
-
 	mutex_lock(&cdma->lock);
 	if (cdma->running) {
 		wait_cdma(cdma, CDMA_EVENT_SYNC_QUEUE_EMPTY);
-		writel(nvhost_channel_dmactrl(true, false, false),
-			chan_regs + HOST1X_CHANNEL_DMACTRL);
-		cdma->running = false;
+		stop_cdma(cdma);
 	}
 	mutex_unlock(&cdma->lock);
 }
@@ -511,6 +602,11 @@ void nvhost_cdma_stop(struct nvhost_cdma *cdma)
 void nvhost_cdma_begin(struct nvhost_cdma *cdma)
 {
 	mutex_lock(&cdma->lock);
+	if (cdma->grow_push_buffer || cdma->grow_sync_queue) {
+		/* drain once per doubling, rather than wait for an idle point */
+		wait_cdma(cdma, CDMA_EVENT_SYNC_QUEUE_EMPTY);
+		resize_cdma(cdma);
+	}
 	if (!cdma->running)
 		start_cdma(cdma);
 	cdma->slots_free = 0;
@@ -561,6 +657,8 @@ void nvhost_cdma_end(struct nvhost_cdma *cdma,
 		add_to_sync_queue(&cdma->sync_queue,
 				sync_point_id, sync_point_value,
 				cdma->slots_used, handles, count);
+		if (++cdma->stats.depth > cdma->stats.max_depth)
+			cdma->stats.max_depth = cdma->stats.depth;
 		/* NumSlots only goes in the first packet */
 		cdma->slots_used = 0;
 		handles += count;
@@ -580,6 +678,17 @@ void nvhost_cdma_update(struct nvhost_cdma *cdma)
 	mutex_unlock(&cdma->lock);
 }
 
+/**
+ * Schedule a cdma update, so that the interrupt thread doesn't have to
+ * wait for the cdma lock while a submit is in progress. The module is
+ * idled for nr_completed submits once the update has retired them.
+ */
+void nvhost_cdma_update_async(struct nvhost_cdma *cdma, int nr_completed)
+{
+	atomic_add(nr_completed, &cdma->nr_completed);
+	schedule_work(&cdma->update);
+}
+
 /**
  * Manually spin until all CDMA has finished. Used if an async update
  * cannot be scheduled for any reason.
@@ -25,6 +25,7 @@
 
 #include <linux/sched.h>
 #include <linux/semaphore.h>
+#include <linux/workqueue.h>
 #include <linux/nvhost.h>
 #include <linux/nvmap.h>
 
@@ -42,15 +43,21 @@
  *	end - start command DMA and enqueue handles to be unpinned
  * Consumer:
  *	update - call to update sync queue and push buffer, unpin memory
+ *	(run from a work item queued by the submit complete interrupt)
  */
 
-/* Size of the sync queue. If it is too small, we won't be able to queue up
- * many command buffers. If it is too large, we waste memory. */
-#define NVHOST_SYNC_QUEUE_SIZE 8192
+/* Initial and maximum size of the sync queue, in words. If it is too small,
+ * we won't be able to queue up many command buffers. If it is too large, we
+ * waste memory, so it starts small and doubles each time a submit has had
+ * to wait for space in it. */
+#define NVHOST_SYNC_QUEUE_SIZE 2048
+#define NVHOST_SYNC_QUEUE_MAX_SIZE 16384
 
-/* Number of gathers we allow to be queued up per channel. Must be a
-   power of two. Currently sized such that pushbuffer is 4KB (512*8B). */
+/* Number of gathers we allow to be queued up per channel, initially and at
+   most. Must be powers of two. Initially sized such that pushbuffer is 4KB
+   (512*8B); it doubles each time a submit has had to wait for space. */
 #define NVHOST_GATHER_QUEUE_SIZE 512
+#define NVHOST_GATHER_QUEUE_MAX_SIZE 4096
 
 struct push_buffer {
 	struct nvmap_handle *mem; /* handle to pushbuffer memory */
@@ -58,12 +65,21 @@ struct push_buffer {
 	u32 phys;		/* physical address of pushbuffer */
 	u32 fence;		/* index we've written */
 	u32 cur;		/* index to write to */
+	u32 size;		/* size in bytes, excluding the final RESTART */
 };
 
 struct sync_queue {
 	unsigned int read;		    /* read position within buffer */
 	unsigned int write;		    /* write position within buffer */
-	u32 buffer[NVHOST_SYNC_QUEUE_SIZE]; /* queue data */
+	unsigned int size;		    /* size of buffer in words */
+	u32 *buffer;			    /* queue data */
+};
+
+struct nvhost_cdma_stats {
+	unsigned int depth;		/* entries in the sync queue */
+	unsigned int max_depth;
+	unsigned int stalls;		/* times a submitter had to wait */
+	u64 stall_us;			/* total time spent waiting */
 };
 
 enum cdma_event {
@@ -82,6 +98,11 @@ struct nvhost_cdma {
 	unsigned int last_put;		/* last value written to DMAPUT */
 	struct push_buffer push_buffer;	/* channel's push buffer */
 	struct sync_queue sync_queue;	/* channel's sync queue */
+	struct work_struct update;	/* retires completed submits */
+	atomic_t nr_completed;		/* submits to idle after retiring */
+	bool grow_push_buffer;		/* resize when next idle */
+	bool grow_sync_queue;
+	struct nvhost_cdma_stats stats;
 	bool running;
 };
 
@@ -94,6 +115,7 @@ void	nvhost_cdma_end(struct nvhost_cdma *cdma,
 		u32 sync_point_id, u32 sync_point_value,
 		struct nvmap_handle **handles, unsigned int nr_handles);
 void	nvhost_cdma_update(struct nvhost_cdma *cdma);
+void	nvhost_cdma_update_async(struct nvhost_cdma *cdma, int nr_completed);
 void	nvhost_cdma_flush(struct nvhost_cdma *cdma);
 
 #endif
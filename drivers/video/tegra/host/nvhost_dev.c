@@ -21,6 +21,7 @@
  */
 
 #include "nvhost_dev.h"
+#include "nvhost_fence.h"
 
 #include <linux/nvhost.h>
 #include <linux/slab.h>
@@ -31,11 +32,15 @@
 #include <linux/platform_device.h>
 #include <linux/uaccess.h>
 #include <linux/file.h>
+#include <linux/vmalloc.h>
 #include <asm/io.h>
 
 #define DRIVER_NAME "tegra_grhost"
 #define IFACE_NAME "nvhost"
 
+/* upper bound on the job stream accepted by one SUBMIT ioctl */
+#define NVHOST_MAX_SUBMIT_SIZE (128 * 1024)
+
 static int nvhost_major = NVHOST_MAJOR;
 static int nvhost_minor = NVHOST_CHANNEL_BASE;
 
@@ -332,6 +337,7 @@ static int nvhost_ioctl_channel_flush(
 		if (err) {
 			dev_warn(&ctx->ch->dev->pdev->dev,
 				"nvhost_syncpt_wait_check failed: %d\n", err);
+			mutex_unlock(&ctx->ch->submitlock);
 			nvmap_unpin(ctx->unpinarray, num_unpin);
 			nvhost_module_idle(&ctx->ch->mod);
 			return err;
@@ -409,6 +415,146 @@ static int nvhost_ioctl_channel_flush(
 	return 0;
 }
 
+/* loads one job from a SUBMIT job stream into the channel context, as
+ * nvhost_channelwrite would, and returns the number of bytes it used */
+static int nvhost_load_job(struct nvhost_channel_userctx *ctx,
+	const u8 *data, size_t remaining)
+{
+	const struct nvhost_submit_hdr *hdr = (const void *)data;
+	const struct nvhost_cmdbuf *cmdbuf;
+	size_t size;
+	u32 i;
+
+	if (remaining < sizeof(*hdr))
+		return -EINVAL;
+	if (!hdr->num_cmdbufs ||
+	    hdr->num_cmdbufs > NVHOST_MAX_GATHERS - 2 ||
+	    hdr->num_relocs > NVHOST_MAX_HANDLES - hdr->num_cmdbufs ||
+	    hdr->num_waitchks > NVHOST_MAX_WAIT_CHECKS - ctx->num_waitchks)
+		return -EINVAL;
+	/* only the channel's own syncpts, as returned by GET_SYNCPOINTS */
+	if (hdr->syncpt_id >= NV_HOST1X_SYNCPT_NB_PTS ||
+	    !(BIT(hdr->syncpt_id) & ctx->ch->desc->syncpts))
+		return -EINVAL;
+
+	size = sizeof(*hdr) +
+		hdr->num_cmdbufs * sizeof(struct nvhost_cmdbuf) +
+		hdr->num_relocs * sizeof(struct nvhost_reloc) +
+		hdr->num_waitchks * sizeof(struct nvhost_waitchk);
+	if (remaining < size)
+		return -EINVAL;
+
+	ctx->syncpt_id = hdr->syncpt_id;
+	ctx->syncpt_incrs = hdr->syncpt_incrs;
+	ctx->waitchk_mask |= hdr->waitchk_mask;
+	/* leave room for ctx switch */
+	ctx->num_gathers = 2;
+	ctx->pinarray_size = 0;
+	data += sizeof(*hdr);
+
+	cmdbuf = (const void *)data;
+	for (i = 0; i < hdr->num_cmdbufs; i++, cmdbuf++)
+		add_gather(ctx, ctx->num_gathers++,
+			(struct nvmap_handle *)cmdbuf->mem,
+			cmdbuf->words, cmdbuf->offset);
+	data = (const u8 *)cmdbuf;
+
+	memcpy(&ctx->pinarray[ctx->pinarray_size], data,
+		hdr->num_relocs * sizeof(struct nvhost_reloc));
+	ctx->pinarray_size += hdr->num_relocs;
+	data += hdr->num_relocs * sizeof(struct nvhost_reloc);
+
+	memcpy(&ctx->waitchks[ctx->num_waitchks], data,
+		hdr->num_waitchks * sizeof(struct nvhost_waitchk));
+	ctx->num_waitchks += hdr->num_waitchks;
+
+	return size;
+}
+
+/* submits a batch of jobs with a single copy of the job stream from
+ * user space. jobs are submitted in order; if one fails after others
+ * went through, success is returned with num_jobs set to the number
+ * submitted, since the ioctl only copies args back on success */
+static int nvhost_ioctl_channel_submit(
+	struct nvhost_channel_userctx *ctx,
+	struct nvhost_submit_args *args)
+{
+	struct nvhost_get_param_args fence = { 0 };
+	u32 on_stack[16];
+	u32 *fences = on_stack;
+	u8 *jobs, *data;
+	size_t remaining = args->size;
+	u32 i;
+	int err = 0;
+
+	if (ctx->relocs_pending || ctx->cmdbufs_pending || ctx->waitchk_pending)
+		return -EBUSY;
+	if (!args->num_jobs)
+		return 0;
+	if (!args->size || args->size > NVHOST_MAX_SUBMIT_SIZE ||
+	    args->num_jobs > args->size / sizeof(struct nvhost_submit_hdr))
+		return -EINVAL;
+
+	if (args->size > PAGE_SIZE)
+		jobs = vmalloc(args->size);
+	else
+		jobs = kmalloc(args->size, GFP_KERNEL);
+	if (args->num_jobs > ARRAY_SIZE(on_stack))
+		fences = kmalloc(args->num_jobs * sizeof(*fences), GFP_KERNEL);
+	if (!jobs || !fences) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(jobs, (void __user *)args->jobs, args->size)) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0, data = jobs; i < args->num_jobs; i++) {
+		int used = nvhost_load_job(ctx, data, remaining);
+		if (used < 0) {
+			dev_err(&ctx->ch->dev->pdev->dev,
+				"malformed job %u in submit\n", i);
+			err = used;
+			break;
+		}
+		data += used;
+		remaining -= used;
+
+		err = nvhost_ioctl_channel_flush(ctx, &fence);
+		if (err)
+			break;
+		fences[i] = fence.value;
+	}
+
+	/* drop the state of a job which failed to load or submit */
+	ctx->num_gathers = 2;
+	ctx->pinarray_size = 0;
+	if (err) {
+		ctx->num_waitchks = 0;
+		ctx->waitchk_mask = 0;
+	}
+
+	args->num_jobs = i;
+	if (i) {
+		err = 0;
+		if (args->fences &&
+		    copy_to_user((void __user *)args->fences, fences,
+				i * sizeof(*fences)))
+			err = -EFAULT;
+	}
+
+out:
+	if (fences != on_stack)
+		kfree(fences);
+	if (args->size > PAGE_SIZE)
+		vfree(jobs);
+	else
+		kfree(jobs);
+	return err;
+}
+
 static long nvhost_channelctl(struct file *filp,
 	unsigned int cmd, unsigned long arg)
 {
@@ -432,6 +578,9 @@ static long nvhost_channelctl(struct file *filp,
 	case NVHOST_IOCTL_CHANNEL_FLUSH:
 		err = nvhost_ioctl_channel_flush(priv, (void *)buf);
 		break;
+	case NVHOST_IOCTL_CHANNEL_SUBMIT:
+		err = nvhost_ioctl_channel_submit(priv, (void *)buf);
+		break;
 	case NVHOST_IOCTL_CHANNEL_GET_SYNCPOINTS:
 		/* host syncpt ID is used by the RM (and never be given out) */
 		BUG_ON(priv->ch->desc->syncpts & (1 << NVSYNCPT_GRAPHICS_HOST));
@@ -557,6 +706,45 @@ static int nvhost_ioctl_ctrl_syncpt_wait(
 					args->thresh, timeout);
 }
 
+static int nvhost_ioctl_ctrl_fence_create(
+	struct nvhost_ctrl_userctx *ctx,
+	struct nvhost_ctrl_fence_create_args *args)
+{
+	struct nvhost_ctrl_fence_pt *pts;
+	size_t size = args->num_pts * sizeof(*pts);
+	int fd;
+
+	if (!args->num_pts || args->num_pts > NVHOST_FENCE_MAX_PTS)
+		return -EINVAL;
+
+	pts = kmalloc(size, GFP_KERNEL);
+	if (!pts)
+		return -ENOMEM;
+
+	if (copy_from_user(pts, args->pts, size))
+		fd = -EFAULT;
+	else
+		fd = nvhost_fence_create(ctx->dev, pts, args->num_pts);
+	kfree(pts);
+
+	if (fd < 0)
+		return fd;
+	args->fd = fd;
+	return 0;
+}
+
+static int nvhost_ioctl_ctrl_fence_merge(
+	struct nvhost_ctrl_userctx *ctx,
+	struct nvhost_ctrl_fence_merge_args *args)
+{
+	int fd = nvhost_fence_merge(ctx->dev, args->fd1, args->fd2);
+
+	if (fd < 0)
+		return fd;
+	args->fd = fd;
+	return 0;
+}
+
 static int nvhost_ioctl_ctrl_module_mutex(
 	struct nvhost_ctrl_userctx *ctx,
 	struct nvhost_ctrl_module_mutex_args *args)
@@ -660,6 +848,12 @@ static long nvhost_ctrlctl(struct file *filp,
 	case NVHOST_IOCTL_CTRL_MODULE_REGRDWR:
 		err = nvhost_ioctl_ctrl_module_regrdwr(priv, (void *)buf);
 		break;
+	case NVHOST_IOCTL_CTRL_FENCE_CREATE:
+		err = nvhost_ioctl_ctrl_fence_create(priv, (void *)buf);
+		break;
+	case NVHOST_IOCTL_CTRL_FENCE_MERGE:
+		err = nvhost_ioctl_ctrl_fence_merge(priv, (void *)buf);
+		break;
 	default:
 		err = -ENOTTY;
 		break;
@@ -0,0 +1,253 @@
+/*
+ * drivers/video/tegra/host/nvhost_fence.c
+ *
+ * Tegra Graphics Host Syncpoint Fences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "nvhost_fence.h"
+#include "nvhost_dev.h"
+
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#define client_managed(id) (BIT(id) & NVSYNCPTS_CLIENT_MANAGED)
+
+struct nvhost_fence_pt {
+	u32 id;
+	u32 thresh;
+	void *ref;		/* interrupt action, if one was needed */
+};
+
+/*
+ * The host is kept busy from creation until every point has expired, the
+ * same as for a blocking syncpt wait. 'pending' counts the points still
+ * waited for, plus one while the fence is being set up.
+ */
+struct nvhost_fence {
+	struct nvhost_dev *dev;
+	wait_queue_head_t wq;
+	atomic_t pending;
+	unsigned int num_pts;
+	struct nvhost_fence_pt pts[0];
+};
+
+static const struct file_operations nvhost_fence_ops;
+
+void nvhost_fence_signal(struct nvhost_fence *fence)
+{
+	if (atomic_dec_and_test(&fence->pending)) {
+		wake_up_interruptible_all(&fence->wq);
+		nvhost_module_idle(&fence->dev->mod);
+	}
+}
+
+static void nvhost_fence_free(struct nvhost_fence *fence)
+{
+	unsigned int i;
+
+	/* after this no more signals can arrive */
+	for (i = 0; i < fence->num_pts; i++)
+		if (fence->pts[i].ref)
+			nvhost_intr_put_ref(&fence->dev->intr, fence->pts[i].ref);
+
+	/* some points were cancelled, so nobody else will idle the host */
+	if (atomic_read(&fence->pending))
+		nvhost_module_idle(&fence->dev->mod);
+
+	kfree(fence);
+}
+
+static int nvhost_fence_arm(struct nvhost_fence *fence,
+			struct nvhost_fence_pt *pt)
+{
+	struct nvhost_syncpt *sp = &fence->dev->syncpt;
+	int err;
+
+	if (nvhost_syncpt_min_cmp(sp, pt->id, pt->thresh))
+		return 0;
+
+	if (client_managed(pt->id) || !nvhost_syncpt_min_eq_max(sp, pt->id)) {
+		u32 val = nvhost_syncpt_update_min(sp, pt->id);
+		if ((s32)(val - pt->thresh) >= 0)
+			return 0;
+	}
+
+	atomic_inc(&fence->pending);
+	err = nvhost_intr_add_action(&fence->dev->intr, pt->id, pt->thresh,
+				NVHOST_INTR_ACTION_SIGNAL_FENCE, fence,
+				&pt->ref);
+	if (err) {
+		atomic_dec(&fence->pending);
+		pt->ref = NULL;
+	}
+	return err;
+}
+
+static int nvhost_fence_release(struct inode *inode, struct file *filp)
+{
+	nvhost_fence_free(filp->private_data);
+	return 0;
+}
+
+static unsigned int nvhost_fence_poll(struct file *filp, poll_table *wait)
+{
+	struct nvhost_fence *fence = filp->private_data;
+
+	poll_wait(filp, &fence->wq, wait);
+
+	return atomic_read(&fence->pending) ? 0 : POLLIN | POLLRDNORM;
+}
+
+static const struct file_operations nvhost_fence_ops = {
+	.owner = THIS_MODULE,
+	.release = nvhost_fence_release,
+	.poll = nvhost_fence_poll,
+};
+
+static int pt_cmp(const void *a, const void *b)
+{
+	const struct nvhost_ctrl_fence_pt *pa = a, *pb = b;
+
+	return (int)pa->id - (int)pb->id;
+}
+
+int nvhost_fence_create(struct nvhost_dev *dev,
+			struct nvhost_ctrl_fence_pt *pts, unsigned int num_pts)
+{
+	struct nvhost_syncpt *sp = &dev->syncpt;
+	struct nvhost_fence *fence;
+	unsigned int i, n;
+	int err = 0;
+	int fd;
+
+	if (!num_pts || num_pts > NVHOST_FENCE_MAX_PTS)
+		return -EINVAL;
+
+	for (i = 0; i < num_pts; i++) {
+		u32 id = pts[i].id;
+		if (id >= NV_HOST1X_SYNCPT_NB_PTS)
+			return -EINVAL;
+		/* a threshold nothing has been submitted for would never
+		 * expire */
+		if (!client_managed(id) &&
+		    (s32)(nvhost_syncpt_read_max(sp, id) - pts[i].thresh) < 0)
+			return -EINVAL;
+	}
+
+	/* fold points on the same sync point into the later threshold */
+	sort(pts, num_pts, sizeof(*pts), pt_cmp, NULL);
+	for (i = 1, n = 1; i < num_pts; i++) {
+		if (pts[i].id != pts[n - 1].id)
+			pts[n++] = pts[i];
+		else if ((s32)(pts[i].thresh - pts[n - 1].thresh) > 0)
+			pts[n - 1].thresh = pts[i].thresh;
+	}
+
+	fence = kzalloc(sizeof(*fence) + n * sizeof(fence->pts[0]),
+			GFP_KERNEL);
+	if (!fence)
+		return -ENOMEM;
+
+	fence->dev = dev;
+	init_waitqueue_head(&fence->wq);
+	atomic_set(&fence->pending, 1);
+	fence->num_pts = n;
+
+	nvhost_module_busy(&dev->mod);
+	for (i = 0; i < n; i++) {
+		fence->pts[i].id = pts[i].id;
+		fence->pts[i].thresh = pts[i].thresh;
+		err = nvhost_fence_arm(fence, &fence->pts[i]);
+		if (err)
+			break;
+	}
+
+	if (err) {
+		nvhost_fence_free(fence);
+		return err;
+	}
+
+	/*
+	 * Drop the setup count; signals if everything has already expired.
+	 * Done before the fd is installed, as from then on another thread
+	 * can close it and free the fence.
+	 */
+	nvhost_fence_signal(fence);
+
+	fd = anon_inode_getfd("nvhost-fence", &nvhost_fence_ops, fence,
+			O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		nvhost_fence_free(fence);
+	return fd;
+}
+
+static struct nvhost_fence *nvhost_fence_fget(int fd, struct file **filp)
+{
+	*filp = fget(fd);
+	if (!*filp)
+		return NULL;
+	if ((*filp)->f_op != &nvhost_fence_ops) {
+		fput(*filp);
+		return NULL;
+	}
+	return (*filp)->private_data;
+}
+
+int nvhost_fence_merge(struct nvhost_dev *dev, int fd1, int fd2)
+{
+	struct nvhost_ctrl_fence_pt *pts;
+	struct nvhost_fence *a, *b;
+	struct file *fa, *fb;
+	unsigned int i, n = 0;
+	int fd;
+
+	a = nvhost_fence_fget(fd1, &fa);
+	if (!a)
+		return -EINVAL;
+	b = nvhost_fence_fget(fd2, &fb);
+	if (!b) {
+		fput(fa);
+		return -EINVAL;
+	}
+
+	pts = kmalloc((a->num_pts + b->num_pts) * sizeof(*pts), GFP_KERNEL);
+	if (!pts) {
+		fd = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < a->num_pts; i++, n++) {
+		pts[n].id = a->pts[i].id;
+		pts[n].thresh = a->pts[i].thresh;
+	}
+	for (i = 0; i < b->num_pts; i++, n++) {
+		pts[n].id = b->pts[i].id;
+		pts[n].thresh = b->pts[i].thresh;
+	}
+
+	fd = nvhost_fence_create(dev, pts, n);
+	kfree(pts);
+
+out:
+	fput(fb);
+	fput(fa);
+	return fd;
+}
@@ -0,0 +1,54 @@
+/*
+ * drivers/video/tegra/host/nvhost_fence.h
+ *
+ * Tegra Graphics Host Syncpoint Fences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __NVHOST_FENCE_H
+#define __NVHOST_FENCE_H
+
+#include <linux/nvhost.h>
+
+#include "nvhost_hardware.h"
+
+struct nvhost_dev;
+struct nvhost_fence;
+
+/* A fence holds at most one point per sync point, but a merge may be
+ * handed two full fences before duplicates are folded together. */
+#define NVHOST_FENCE_MAX_PTS (2 * NV_HOST1X_SYNCPT_NB_PTS)
+
+/**
+ * Create a fence that signals once each sync point has reached its
+ * threshold, and return a new file descriptor for it.
+ * The pts array is sorted in place.
+ */
+int nvhost_fence_create(struct nvhost_dev *dev,
+			struct nvhost_ctrl_fence_pt *pts, unsigned int num_pts);
+
+/**
+ * Create a fence that signals once both fences have signalled, and return a
+ * new file descriptor for it.
+ */
+int nvhost_fence_merge(struct nvhost_dev *dev, int fd1, int fd2);
+
+/**
+ * Called by the interrupt code as each point of the fence expires.
+ */
+void nvhost_fence_signal(struct nvhost_fence *fence);
+
+#endif
@@ -22,6 +22,7 @@
 
 #include "nvhost_intr.h"
 #include "nvhost_dev.h"
+#include "nvhost_fence.h"
 #include <linux/interrupt.h>
 #include <linux/slab.h>
 #include <linux/irq.h>
@@ -172,8 +173,7 @@ static void action_submit_complete(struct nvhost_waitlist *waiter)
 	struct nvhost_channel *channel = waiter->data;
 	int nr_completed = waiter->count;
 
-	nvhost_cdma_update(&channel->cdma);
-	nvhost_module_idle_mult(&channel->mod, nr_completed);
+	nvhost_cdma_update_async(&channel->cdma, nr_completed);
 }
 
 static void action_ctxsave(struct nvhost_waitlist *waiter)
@@ -198,6 +198,11 @@ static void action_wakeup_interruptible(struct nvhost_waitlist *waiter)
 	wake_up_interruptible(wq);
 }
 
+static void action_signal_fence(struct nvhost_waitlist *waiter)
+{
+	nvhost_fence_signal(waiter->data);
+}
+
 typedef void (*action_handler)(struct nvhost_waitlist *waiter);
 
 static action_handler action_handlers[NVHOST_INTR_ACTION_COUNT] = {
@@ -205,6 +210,7 @@ static action_handler action_handlers[NVHOST_INTR_ACTION_COUNT] = {
 	action_ctxsave,
 	action_wakeup,
 	action_wakeup_interruptible,
+	action_signal_fence,
 };
 
 static void run_handlers(struct list_head completed[NVHOST_INTR_ACTION_COUNT])
@@ -55,6 +55,12 @@ enum nvhost_intr_action {
 	 */
 	NVHOST_INTR_ACTION_WAKEUP_INTERRUPTIBLE,
 
+	/**
+	 * Signal one point of a fence.
+	 * 'data' points to a fence
+	 */
+	NVHOST_INTR_ACTION_SIGNAL_FENCE,
+
 	NVHOST_INTR_ACTION_COUNT
 };
 
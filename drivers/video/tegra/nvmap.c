@@ -49,6 +49,7 @@
 #include <linux/seq_file.h>
 #include <linux/oom.h>
 #include <linux/syscalls.h>
+#include <linux/workqueue.h>
 #include <asm/tlbflush.h>
 #include <mach/iovmm.h>
 #include "nvcommon.h"
@@ -145,12 +146,17 @@ static DECLARE_WAIT_QUEUE_HEAD(nvmap_ptefull);
 /* used to lost the master tree of memory handles */
 static DEFINE_SPINLOCK(nvmap_handle_lock);
 
-/* only one task may be performing pin / unpin operations at once, to
- * prevent deadlocks caused by interleaved IOVMM re-allocations */
+/* only one task may be pinning unpinned handles at once, to prevent
+ * deadlocks caused by interleaved IOVMM re-allocations. nested pins of
+ * already-pinned handles and unpins don't take it */
 static DEFINE_MUTEX(nvmap_pin_lock);
 
 /* queue of tasks which are blocking on pin, for IOVMM room */
 static DECLARE_WAIT_QUEUE_HEAD(nvmap_pin_wait);
+
+/* incremented whenever an unpin makes IOVMM space reclaimable, so that
+ * tasks blocked on pin can tell whether a retry may succeed */
+static atomic_t nvmap_pin_seq = ATOMIC_INIT(0);
 static struct rb_root nvmap_handles = RB_ROOT;
 
 static struct tegra_iovmm_client *nvmap_vm_client = NULL;
@@ -192,7 +198,8 @@ static unsigned int _nvmap_heap_policy (unsigned int heaps, int numpages)
 	return 0;
 };
 
-/* first-fit linear allocator carveout heap manager */
+/* best-fit carveout heap manager. blocks are kept in address order, and
+ * free blocks are additionally indexed by size in an rbtree */
 struct nvmap_mem_block {
 	struct nvmap_handle *h; /* backlink to handle for compaction */
 	unsigned long	base;
@@ -203,6 +210,7 @@ struct nvmap_mem_block {
 	short		prev; /* previous absolute (address-order) block */
 	short		next_free;
 	short		prev_free;
+	struct rb_node	free_node; /* free blocks, by size then base */
 
 	/* debugfs realted */
 	ktime_t		time;
@@ -220,6 +228,7 @@ struct nvmap_carveout {
 	short			spare_index;
 	short			free_index;
 	short			block_index;
+	struct rb_root		free_tree;
 	spinlock_t		lock;
 	const char		*name;
 	struct nvmap_mem_block	*blocks;
@@ -233,8 +242,22 @@ enum {
 	CARVEOUT_STAT_LARGEST_BLOCK,
 	CARVEOUT_STAT_LARGEST_FREE,
 	CARVEOUT_STAT_BASE,
+	CARVEOUT_STAT_FRAGMENTATION,
 };
 
+/* try to relocate unpinned carveout handles when an allocation fails */
+static bool nvmap_carveout_compaction = true;
+module_param_named(carveout_compaction, nvmap_carveout_compaction, bool, 0644);
+
+/* must be called with the carveout lock held */
+static size_t nvmap_largest_free(struct nvmap_carveout *co)
+{
+	struct rb_node *n = rb_last(&co->free_tree);
+
+	if (!n) return 0;
+	return rb_entry(n, struct nvmap_mem_block, free_node)->size;
+}
+
 
 static inline pgprot_t _nvmap_flag_to_pgprot(unsigned long flag, pgprot_t base)
 {
@@ -268,6 +291,24 @@ static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 		return val;
 	}
 
+	if (stat==CARVEOUT_STAT_LARGEST_FREE) {
+		val = nvmap_largest_free(co);
+		spin_unlock(&co->lock);
+		return val;
+	}
+
+	/* percentage of the free space which is not in the largest free
+	 * block: 0 if all free space is contiguous */
+	if (stat==CARVEOUT_STAT_FRAGMENTATION) {
+		u64 largest = nvmap_largest_free(co);
+		for (idx=co->free_index; idx!=-1; idx=co->blocks[idx].next_free)
+			val += co->blocks[idx].size;
+		if (val)
+			val = 100 - div64_u64(largest * 100, val);
+		spin_unlock(&co->lock);
+		return val;
+	}
+
 	if (stat==CARVEOUT_STAT_TOTAL_SIZE ||
 	    stat==CARVEOUT_STAT_NUM_BLOCKS ||
 	    stat==CARVEOUT_STAT_LARGEST_BLOCK)
@@ -297,10 +338,6 @@ static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 			val ++;
 			idx = co->blocks[idx].next_free;
 			break;
-		case CARVEOUT_STAT_LARGEST_FREE:
-			val = max_t(unsigned long, val, co->blocks[idx].size);
-			idx = co->blocks[idx].next_free;
-			break;
 	    }
 	}
 
@@ -331,6 +368,7 @@ static int _nvmap_init_carveout(struct nvmap_carveout *co,
 		blocks[i].prev = i-1;
 		blocks[i].next_free = -1;
 		blocks[i].prev_free = -1;
+		RB_CLEAR_NODE(&blocks[i].free_node);
 		blocks[i].co_heap = co;
 	}
 	blocks[i-1].next = -1;
@@ -349,6 +387,9 @@ static int _nvmap_init_carveout(struct nvmap_carveout *co,
 	co->block_index = 0;
 	co->spare_index = 1;
 	co->free_index = 0;
+	co->free_tree = RB_ROOT;
+	rb_link_node(&blocks[0].free_node, NULL, &co->free_tree.rb_node);
+	rb_insert_color(&blocks[0].free_node, &co->free_tree);
 	return 0;
 
 fail:
@@ -368,15 +409,58 @@ static int nvmap_get_spare(struct nvmap_carveout *co) {
 	co->blocks[idx].prev = -1;
 	co->blocks[idx].next_free = -1;
 	co->blocks[idx].prev_free = -1;
+	RB_CLEAR_NODE(&co->blocks[idx].free_node);
 	return idx;
 }
 
 #define BLOCK(_co, _idx) ((_idx)==-1 ? NULL : &(_co)->blocks[(_idx)])
 
+static void nvmap_free_tree_insert(struct nvmap_carveout *co, int idx)
+{
+	struct nvmap_mem_block *b = BLOCK(co, idx);
+	struct rb_node **p = &co->free_tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct nvmap_mem_block *l;
+		parent = *p;
+		l = rb_entry(parent, struct nvmap_mem_block, free_node);
+		if (b->size < l->size ||
+		    (b->size == l->size && b->base < l->base))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&b->free_node, parent, p);
+	rb_insert_color(&b->free_node, &co->free_tree);
+}
+
+static void nvmap_free_tree_erase(struct nvmap_carveout *co, int idx)
+{
+	struct nvmap_mem_block *b = BLOCK(co, idx);
+
+	if (RB_EMPTY_NODE(&b->free_node)) return;
+	rb_erase(&b->free_node, &co->free_tree);
+	RB_CLEAR_NODE(&b->free_node);
+}
+
+static void nvmap_insert_free(struct nvmap_carveout *co, int idx)
+{
+	struct nvmap_mem_block *b = BLOCK(co, idx);
+
+	b->prev_free = -1;
+	b->next_free = co->free_index;
+	if (co->free_index != -1)
+		co->blocks[co->free_index].prev_free = idx;
+	co->free_index = idx;
+	nvmap_free_tree_insert(co, idx);
+}
+
 static void nvmap_zap_free(struct nvmap_carveout *co, int idx)
 {
 	struct nvmap_mem_block *block;
 
+	nvmap_free_tree_erase(co, idx);
 	block = BLOCK(co, idx);
 	if (block->prev_free != -1)
 		BLOCK(co, block->prev_free)->next_free = block->next_free;
@@ -395,6 +479,10 @@ static int nvmap_split_block(struct nvmap_carveout *co,
 {
 	struct nvmap_mem_block *block = BLOCK(co, idx);
 
+	/* the block's size changes below, so it can't stay in the size
+	 * tree; it is dropped from the free list once the split succeeds */
+	nvmap_free_tree_erase(co, idx);
+
 	if (block->base < start) {
 		int spare_idx = nvmap_get_spare(co);
 		struct nvmap_mem_block *spare = BLOCK(co, spare_idx);
@@ -413,14 +501,11 @@ static int nvmap_split_block(struct nvmap_carveout *co,
 				co->blocks[spare->prev].next = spare_idx;
 			else
 				co->block_index = spare_idx;
-			spare->prev_free = -1;
-			spare->next_free = co->free_index;
-			if (co->free_index != -1)
-				co->blocks[co->free_index].prev_free = spare_idx;
-			co->free_index = spare_idx;
+			nvmap_insert_free(co, spare_idx);
 		} else {
 			/* not being able to split is fatal here, because we
 			 * need to realign block->base */
+			nvmap_free_tree_insert(co, idx);
 			return -ENOMEM;
 		}
 	}
@@ -440,11 +525,7 @@ static int nvmap_split_block(struct nvmap_carveout *co,
 			block->next = spare_idx;
 			if (spare->next != -1)
 				co->blocks[spare->next].prev = spare_idx;
-			spare->prev_free = -1;
-			spare->next_free = co->free_index;
-			if (co->free_index != -1)
-				co->blocks[co->free_index].prev_free = spare_idx;
-			co->free_index = spare_idx;
+			nvmap_insert_free(co, spare_idx);
 		}
 	}
 
@@ -520,7 +601,7 @@ static void nvmap_carveout_free(struct nvmap_carveout *co, int idx, bool lock)
 		nvmap_insert_block(spare, co, zap);
 	}
 
-	nvmap_insert_block(free, co, idx);
+	nvmap_insert_free(co, idx);
 	if (lock) spin_unlock(&co->lock);
 }
 
@@ -530,14 +611,55 @@ static void nvmap_add_debug_fs_node(struct nvmap_carveout_node *n,
 	struct nvmap_carveout* co, int idx);
 #endif
 
+/* best-fit: the smallest free block which can hold the aligned allocation */
+static int nvmap_carveout_best_fit_locked(struct nvmap_carveout *co,
+	size_t align, size_t size)
+{
+	struct rb_node *n = co->free_tree.rb_node;
+	struct rb_node *first = NULL;
+
+	while (n) {
+		struct nvmap_mem_block *b;
+		b = rb_entry(n, struct nvmap_mem_block, free_node);
+		if (b->size >= size) {
+			first = n;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	for (n = first; n; n = rb_next(n)) {
+		struct nvmap_mem_block *b;
+		size_t ljust;
+		int idx;
+
+		b = rb_entry(n, struct nvmap_mem_block, free_node);
+		ljust = (b->base + align - 1) & ~(align-1);
+		if (b->base + b->size < ljust + size)
+			continue;
+
+		/* a failed split leaves the block unchanged in the tree */
+		idx = b - co->blocks;
+		if (!nvmap_split_block(co, idx, ljust, size, align))
+			return idx;
+	}
+
+	return -1;
+}
+
 static int nvmap_carveout_alloc_locked(struct nvmap_carveout_node *n,
 	struct nvmap_carveout *co, size_t align, size_t size, int idx_last)
 {
 	int idx;
 
+	if (idx_last == -1) {
+		idx = nvmap_carveout_best_fit_locked(co, align, size);
+		goto out;
+	}
+
 	/* if idx_last is passed in as not -1, we'd want bottom_up
 	 * allocation */
-	idx = (idx_last != -1) ? co->block_index : co->free_index;
+	idx = co->block_index;
 
 	while (idx != -1) {
 		size_t ljust;
@@ -562,9 +684,10 @@ static int nvmap_carveout_alloc_locked(struct nvmap_carveout_node *n,
 			return -1;
 		}
 
-		idx = (idx_last != -1) ? b->next : b->next_free;
+		idx = b->next;
 	}
 
+out:
 #if NVMAP_DEBUG_FS
 	if (idx != -1)  {
 		nvmap_add_debug_fs_node(n, co, idx);
@@ -759,6 +882,16 @@ static ssize_t _nvmap_sysfs_show_heap_free_max(struct device *d,
 			CARVEOUT_STAT_LARGEST_FREE));
 }
 
+static ssize_t _nvmap_sysfs_show_heap_fragmentation(struct device *d,
+	struct device_attribute *attr, char *buf)
+{
+	struct nvmap_carveout_node *c = container_of(d,
+		struct nvmap_carveout_node, dev);
+	return sprintf(buf, "%lu\n",
+		_nvmap_carveout_blockstat(&c->carveout,
+			CARVEOUT_STAT_FRAGMENTATION));
+}
+
 static ssize_t _nvmap_sysfs_show_heap_total_count(struct device *d,
 	struct device_attribute *attr, char *buf)
 {
@@ -862,6 +995,7 @@ static NVMAP_CARVEOUT_ATTR_RO(base);
 static NVMAP_CARVEOUT_ATTR_RO(free_size);
 static NVMAP_CARVEOUT_ATTR_RO(free_count);
 static NVMAP_CARVEOUT_ATTR_RO(free_max);
+static NVMAP_CARVEOUT_ATTR_RO(fragmentation);
 static NVMAP_CARVEOUT_ATTR_RO(total_size);
 static NVMAP_CARVEOUT_ATTR_RO(total_count);
 static NVMAP_CARVEOUT_ATTR_RO(total_max);
@@ -878,6 +1012,7 @@ static struct attribute *nvmap_heap_default_attrs[] = {
 	&nvmap_heap_attr_free_count.attr,
 	&nvmap_heap_attr_total_max.attr,
 	&nvmap_heap_attr_free_max.attr,
+	&nvmap_heap_attr_fragmentation.attr,
 	NULL
 };
 
@@ -940,10 +1075,15 @@ static void nvmap_add_debug_fs_node(struct nvmap_carveout_node *n,
 static struct device *__nvmap_heap_parent_dev(void);
 #define _nvmap_heap_parent_dev __nvmap_heap_parent_dev()
 
-/* unpinned I/O VMM areas may be reclaimed by nvmap to make room for
- * new surfaces. unpinned surfaces are stored in segregated linked-lists
- * sorted in most-recently-unpinned order (i.e., head insertion, head
- * removal */
+/* a handle keeps its I/O VMM area and GART mapping when it is unpinned, so
+ * that pinning it again needs no IOVMM allocation or remapping. unpinned
+ * areas may be reclaimed by nvmap to make room for new surfaces; they are
+ * stored in segregated linked-lists sorted in most-recently-unpinned order
+ * (i.e., head insertion), and reclaimed least-recently-unpinned first */
+static unsigned int nvmap_iovmm_cache_hits;
+static unsigned int nvmap_iovmm_cache_misses;
+static unsigned int nvmap_iovmm_cache_evictions;
+
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
 static DEFINE_SPINLOCK(nvmap_mru_vma_lock);
 static const size_t nvmap_mru_cutoff[] = {
@@ -1095,21 +1235,22 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 		INIT_LIST_HEAD(&h->pgalloc.mru_list);
 		return vm;
 	}
-	/* attempt to re-use the most recently unpinned IOVMM area in the
-	 * same size bin as the current handle. If that fails, iteratively
-	 * evict handles (starting from the current bin) until an allocation
-	 * succeeds or no more areas can be evicted */
+	/* attempt to re-use the least recently unpinned IOVMM area in the
+	 * same size bin as the current handle which is large enough. If
+	 * that fails, iteratively evict handles (starting from the current
+	 * bin, oldest first) until an allocation succeeds or no more areas
+	 * can be evicted */
 
 	spin_lock(&nvmap_mru_vma_lock);
 	mru = _nvmap_list(h->size);
-	if (!list_empty(mru))
-		evict = list_first_entry(mru, struct nvmap_handle,
-			pgalloc.mru_list);
-	if (evict && evict->pgalloc.area->iovm_length >= h->size) {
+	list_for_each_entry_reverse(evict, mru, pgalloc.mru_list) {
+		if (evict->pgalloc.area->iovm_length < h->size)
+			continue;
 		list_del(&evict->pgalloc.mru_list);
 		vm = evict->pgalloc.area;
 		evict->pgalloc.area = NULL;
 		INIT_LIST_HEAD(&evict->pgalloc.mru_list);
+		nvmap_iovmm_cache_evictions++;
 		spin_unlock(&nvmap_mru_vma_lock);
 		return vm;
 	}
@@ -1121,13 +1262,14 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 			idx -= ARRAY_SIZE(nvmap_mru_vma_lists);
 		mru = &nvmap_mru_vma_lists[idx];
 		while (!list_empty(mru) && !vm) {
-			evict = list_first_entry(mru, struct nvmap_handle,
+			evict = list_entry(mru->prev, struct nvmap_handle,
 				pgalloc.mru_list);
 
 			BUG_ON(atomic_add_return(0, &evict->pin)!=0);
 			BUG_ON(!evict->pgalloc.area);
 			list_del(&evict->pgalloc.mru_list);
 			INIT_LIST_HEAD(&evict->pgalloc.mru_list);
+			nvmap_iovmm_cache_evictions++;
 			spin_unlock(&nvmap_mru_vma_lock);
 			tegra_iovmm_free_vm(evict->pgalloc.area);
 			evict->pgalloc.area = NULL;
@@ -1171,6 +1313,232 @@ int nvmap_get_unpinned_iovmm_memory(int *total_unpinned_mem,
 static int _nvmap_do_cache_maint(struct nvmap_handle *h,
 	unsigned long start, unsigned long end, unsigned long op, bool get);
 
+extern void v7_flush_kern_cache_all(void *);
+extern void v7_clean_kern_cache_all(void *);
+#define FLUSH_CLEAN_BY_SET_WAY_THRESHOLD (3 * PAGE_SIZE)
+
+#define nvmap_gfp (GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
+
+/* page-allocated handles are built from pools of pages which are known not
+ * to be present in any CPU cache, one pool per cache attribute. pages are
+ * returned to the pool of their handle when it is freed, and the pools are
+ * topped up in the background after allocations drain them, so that most
+ * allocations neither call the page allocator nor perform cache maintenance.
+ * the pools are released under memory pressure by a shrinker. */
+enum {
+	NVMAP_POOL_UC,
+	NVMAP_POOL_WC,
+	NVMAP_POOL_CACHED,
+	NVMAP_NUM_POOLS,
+};
+
+struct nvmap_page_pool {
+	spinlock_t lock;
+	struct page **pages;
+	unsigned int npages;
+	unsigned int max;
+	unsigned int hits;
+	unsigned int misses;
+};
+
+static struct nvmap_page_pool nvmap_pools[NVMAP_NUM_POOLS];
+static unsigned int nvmap_pool_size = 512;
+module_param_named(pool_size, nvmap_pool_size, uint, 0400);
+
+static DEFINE_SPINLOCK(nvmap_alloc_stat_lock);
+static unsigned int nvmap_alloc_count;
+static u64 nvmap_alloc_total_us;
+static unsigned int nvmap_alloc_max_us;
+
+#define NVMAP_POOL_REFILL_BATCH 64
+static void nvmap_pool_refill(struct work_struct *work);
+static DECLARE_WORK(nvmap_pool_refill_work, nvmap_pool_refill);
+
+static inline struct nvmap_page_pool *_nvmap_handle_pool(struct nvmap_handle *h)
+{
+	switch (h->flags) {
+	case NVMEM_HANDLE_UNCACHEABLE:
+		return &nvmap_pools[NVMAP_POOL_UC];
+	case NVMEM_HANDLE_WRITE_COMBINE:
+		return &nvmap_pools[NVMAP_POOL_WC];
+	default:
+		return &nvmap_pools[NVMAP_POOL_CACHED];
+	}
+}
+
+/* writes back and invalidates the outer cache for a set of pages, with one
+ * range operation per physically contiguous run */
+static void _nvmap_outer_flush_pages(struct page **pages, unsigned int cnt)
+{
+	unsigned int i, j;
+	phys_addr_t base;
+
+	for (i=0; i<cnt; i=j) {
+		base = page_to_phys(pages[i]);
+		for (j=i+1; j<cnt; j++)
+			if (page_to_phys(pages[j]) != base + ((j-i)<<PAGE_SHIFT))
+				break;
+		outer_flush_range(base, base + ((j-i)<<PAGE_SHIFT));
+	}
+}
+
+/* removes a set of newly-allocated pages from all CPU caches */
+static void _nvmap_flush_pages(struct page **pages, unsigned int cnt)
+{
+	unsigned int i;
+	void *km;
+
+	if (!cnt) return;
+
+	if ((cnt << PAGE_SHIFT) >= FLUSH_CLEAN_BY_SET_WAY_THRESHOLD) {
+		on_each_cpu(v7_flush_kern_cache_all, NULL, 1);
+	} else {
+		for (i=0; i<cnt; i++) {
+			km = kmap(pages[i]);
+			if (km) __cpuc_flush_dcache_area(km, PAGE_SIZE);
+			kunmap(pages[i]);
+		}
+	}
+	_nvmap_outer_flush_pages(pages, cnt);
+}
+
+/* takes up to cnt pages from the pool, returns the number taken */
+static unsigned int _nvmap_pool_get(struct nvmap_page_pool *pool,
+	struct page **pages, unsigned int cnt)
+{
+	unsigned int n;
+	bool refill;
+
+	spin_lock(&pool->lock);
+	n = min(cnt, pool->npages);
+	pool->npages -= n;
+	memcpy(pages, &pool->pages[pool->npages], n * sizeof(*pages));
+	pool->hits += n;
+	pool->misses += cnt - n;
+	refill = pool->npages < pool->max / 4;
+	spin_unlock(&pool->lock);
+
+	if (refill)
+		schedule_work(&nvmap_pool_refill_work);
+
+	return n;
+}
+
+/* returns the pages of a freed handle to its pool, and the remainder to
+ * the page allocator. pages must already be clean in the inner cache. */
+static void _nvmap_pool_put(struct nvmap_handle *h,
+	struct page **pages, unsigned int cnt)
+{
+	struct nvmap_page_pool *pool = _nvmap_handle_pool(h);
+	unsigned int n;
+
+	/* inner-cacheable handles are only written back from L1 on free */
+	if (h->flags == NVMEM_HANDLE_INNER_CACHEABLE && pool->npages < pool->max)
+		_nvmap_outer_flush_pages(pages, cnt);
+
+	spin_lock(&pool->lock);
+	n = min(cnt, pool->max - pool->npages);
+	memcpy(&pool->pages[pool->npages], pages, n * sizeof(*pages));
+	pool->npages += n;
+	spin_unlock(&pool->lock);
+
+	while (cnt > n)
+		__free_page(pages[--cnt]);
+}
+
+static void nvmap_pool_refill(struct work_struct *work)
+{
+	struct page *batch[NVMAP_POOL_REFILL_BATCH];
+	struct nvmap_page_pool *pool;
+	unsigned int i, n, want;
+
+	for (i=0; i<NVMAP_NUM_POOLS; i++) {
+		pool = &nvmap_pools[i];
+		for (;;) {
+			spin_lock(&pool->lock);
+			want = pool->max / 2;
+			want = (pool->npages < want) ? want - pool->npages : 0;
+			spin_unlock(&pool->lock);
+			want = min_t(unsigned int, want, ARRAY_SIZE(batch));
+			if (!want)
+				break;
+
+			for (n=0; n<want; n++) {
+				batch[n] = alloc_page(nvmap_gfp | __GFP_NORETRY);
+				if (!batch[n])
+					break;
+			}
+			_nvmap_flush_pages(batch, n);
+
+			spin_lock(&pool->lock);
+			want = min(n, pool->max - pool->npages);
+			memcpy(&pool->pages[pool->npages], batch,
+				want * sizeof(*batch));
+			pool->npages += want;
+			spin_unlock(&pool->lock);
+
+			while (n > want)
+				__free_page(batch[--n]);
+			if (n < ARRAY_SIZE(batch))
+				break;
+		}
+	}
+}
+
+static int nvmap_pool_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct nvmap_page_pool *pool;
+	struct page *page;
+	unsigned int i;
+	int total = 0;
+
+	for (i=0; i<NVMAP_NUM_POOLS; i++) {
+		pool = &nvmap_pools[i];
+		while (nr_to_scan > 0) {
+			spin_lock(&pool->lock);
+			page = pool->npages ? pool->pages[--pool->npages] : NULL;
+			spin_unlock(&pool->lock);
+			if (!page)
+				break;
+			__free_page(page);
+			nr_to_scan--;
+		}
+		total += pool->npages;
+	}
+	return total;
+}
+
+static struct shrinker nvmap_pool_shrinker = {
+	.shrink = nvmap_pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static void nvmap_pool_init(void)
+{
+	struct nvmap_page_pool *pool;
+	unsigned int i;
+
+	for (i=0; i<NVMAP_NUM_POOLS; i++) {
+		pool = &nvmap_pools[i];
+		spin_lock_init(&pool->lock);
+		pool->pages = vmalloc(nvmap_pool_size * sizeof(*pool->pages));
+		pool->max = pool->pages ? nvmap_pool_size : 0;
+	}
+	register_shrinker(&nvmap_pool_shrinker);
+}
+
+static void _nvmap_alloc_stat(ktime_t start)
+{
+	unsigned int us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	spin_lock(&nvmap_alloc_stat_lock);
+	nvmap_alloc_count++;
+	nvmap_alloc_total_us += us;
+	if (us > nvmap_alloc_max_us)
+		nvmap_alloc_max_us = us;
+	spin_unlock(&nvmap_alloc_stat_lock);
+}
+
 void _nvmap_handle_free(struct nvmap_handle *h)
 {
 	int e;
@@ -1247,10 +1615,9 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 				h->size);
 		_nvmap_remove_mru_vma(h);
 		if (h->pgalloc.area) tegra_iovmm_free_vm(h->pgalloc.area);
-		for (i=0; i<h->size>>PAGE_SHIFT; i++) {
+		for (i=0; i<h->size>>PAGE_SHIFT; i++)
 			ClearPageReserved(h->pgalloc.pages[i]);
-			__free_page(h->pgalloc.pages[i]);
-		}
+		_nvmap_pool_put(h, h->pgalloc.pages, h->size>>PAGE_SHIFT);
 		if ((h->size>>PAGE_SHIFT)*sizeof(struct page*)>=PAGE_SIZE)
 			vfree(h->pgalloc.pages);
 		else
@@ -1260,8 +1627,6 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 	kfree(h);
 }
 
-#define nvmap_gfp (GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
-
 /* map the backing pages for a heap_pgalloc handle into its IOVMM area */
 static void _nvmap_handle_iovmm_map(struct nvmap_handle *h)
 {
@@ -1285,7 +1650,9 @@ static void _nvmap_handle_iovmm_map(struct nvmap_handle *h)
 static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 {
 	unsigned int i = 0, cnt = (h->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	unsigned int pooled = 0;
 	struct page **pages;
+	ktime_t start = ktime_get();
 
 	if (cnt*sizeof(*pages)>=PAGE_SIZE)
 		pages = vmalloc(cnt*sizeof(*pages));
@@ -1305,7 +1672,8 @@ static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 		for (; i<(1<<order); i++)
 			__free_page(nth_page(compound_page, i));
 	} else {
-		for (i=0; i<cnt; i++) {
+		pooled = _nvmap_pool_get(_nvmap_handle_pool(h), pages, cnt);
+		for (i=pooled; i<cnt; i++) {
 			pages[i] = alloc_page(nvmap_gfp);
 			if (!pages[i]) {
 			    pr_err("failed to allocate %u pages after %u entries\n",
@@ -1326,20 +1694,16 @@ static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 	}
 #endif
 
-	for (i=0; i<cnt; i++) {
-		void *km;
+	for (i=0; i<cnt; i++)
 		SetPageReserved(pages[i]);
-		km = kmap(pages[i]);
-		if (km) __cpuc_flush_dcache_area(km, PAGE_SIZE);
-		outer_flush_range(page_to_phys(pages[i]),
-			page_to_phys(pages[i])+PAGE_SIZE);
-		kunmap(pages[i]);
-	}
+	/* pooled pages are already clean */
+	_nvmap_flush_pages(pages + pooled, cnt - pooled);
 
 	h->size = cnt<<PAGE_SHIFT;
 	h->pgalloc.pages = pages;
 	h->pgalloc.contig = contiguous;
 	INIT_LIST_HEAD(&h->pgalloc.mru_list);
+	_nvmap_alloc_stat(start);
 	return 0;
 
 fail:
@@ -1616,6 +1980,21 @@ struct nvmap_handle_ref *_nvmap_ref_lookup_locked(
 	return NULL;
 }
 
+/* takes a nested pin on a handle which is already pinned. the handle's
+ * IOVMM area or carveout block can't move while it is pinned, so this
+ * doesn't need nvmap_pin_lock. returns false if the handle isn't pinned */
+static bool _nvmap_handle_pin_nested(struct nvmap_handle *h)
+{
+	h = _nvmap_handle_get(h);
+	if (!h) return false;
+
+	if (atomic_inc_not_zero(&h->pin))
+		return true;
+
+	_nvmap_handle_put(h);
+	return false;
+}
+
 /* must be called inside nvmap_pin_lock, to ensure that an entire stream
  * of pins will complete without competition from a second stream. returns
  * 0 if the pin was successful, -ENOMEM on failure */
@@ -1627,26 +2006,34 @@ static int _nvmap_handle_pin_locked(struct nvmap_handle *h)
 	h = _nvmap_handle_get(h);
 	if (!h) return -ENOMEM;
 
-	if (atomic_inc_return(&h->pin)==1) {
-		if (h->heap_pgalloc && !h->pgalloc.contig) {
-			area = _nvmap_get_vm(h);
-			if (!area) {
-				/* no race here, inside the pin mutex */
-				atomic_dec(&h->pin);
-				_nvmap_handle_put(h);
-				return -ENOMEM;
-			}
-			if (area != h->pgalloc.area)
-				h->pgalloc.dirty = true;
-			h->pgalloc.area = area;
-		}
-		if (h->alloc && !h->heap_pgalloc) {
-			spin_lock(&h->carveout.co_heap->lock);
-			BLOCK(h->carveout.co_heap, h->carveout.block_idx)->align
-				|= NVMAP_BLOCK_ALIGN_PINNED;
-			spin_unlock(&h->carveout.co_heap->lock);
+	if (atomic_inc_not_zero(&h->pin))
+		return 0;
+
+	/* the pin count stays at zero until the handle is fully pinned, so
+	 * that _nvmap_handle_pin_nested never sees a half-pinned handle */
+	if (h->heap_pgalloc && !h->pgalloc.contig) {
+		area = _nvmap_get_vm(h);
+		if (!area) {
+			_nvmap_handle_put(h);
+			return -ENOMEM;
 		}
+		if (area != h->pgalloc.area)
+			h->pgalloc.dirty = true;
+		h->pgalloc.area = area;
+		/* inside the pin mutex, so the counters need no lock */
+		if (h->pgalloc.dirty)
+			nvmap_iovmm_cache_misses++;
+		else
+			nvmap_iovmm_cache_hits++;
+	}
+	if (h->alloc && !h->heap_pgalloc) {
+		spin_lock(&h->carveout.co_heap->lock);
+		BLOCK(h->carveout.co_heap, h->carveout.block_idx)->align
+			|= NVMAP_BLOCK_ALIGN_PINNED;
+		spin_unlock(&h->carveout.co_heap->lock);
 	}
+	smp_mb__before_atomic_inc();
+	atomic_inc(&h->pin);
 	return 0;
 }
 
@@ -1682,6 +2069,7 @@ static int _nvmap_handle_unpin(struct nvmap_handle *h)
 				h->pgalloc.dirty = true;
 			}
 			_nvmap_insert_mru_vma(h);
+			atomic_inc(&nvmap_pin_seq);
 			ret=1;
 		}
 		if (h->alloc && !h->heap_pgalloc) {
@@ -1699,42 +2087,89 @@ static int _nvmap_handle_unpin(struct nvmap_handle *h)
 	return ret;
 }
 
-/* pin a list of handles, mapping IOVMM areas if needed. may sleep, if
- * a handle's IOVMM area has been reclaimed and insufficient IOVMM space
- * is available to complete the list pin. no intervening pin operations
- * will interrupt this, and no validation is performed on the handles
- * that are provided. */
-static int _nvmap_handle_pin_fast(unsigned int nr, struct nvmap_handle **h)
+/* pins every handle in the list or none of them; must be called inside
+ * nvmap_pin_lock. on failure, returns -ENOMEM and stores in *unwound the
+ * number of IOVMM areas which were made reclaimable again while undoing
+ * the partial pin */
+static int _nvmap_handle_pin_array_locked(unsigned int nr,
+	struct nvmap_handle **h, int *unwound)
 {
 	unsigned int i;
-	int ret = 0;
 
-	if ( !(h && *h && ((*h)->alloc)) ) {
-		pr_err("%s invalid handle, returning -EINVAL\n",__func__);
-		return -EINVAL;
-	}
+	for (i=0; i<nr; i++)
+		if (_nvmap_handle_pin_locked(h[i]))
+			break;
 
-	mutex_lock(&nvmap_pin_lock);
-	for (i=0; i<nr && !ret; i++) {
-		ret = wait_event_interruptible(nvmap_pin_wait,
-			!_nvmap_handle_pin_locked(h[i]));
+	if (i == nr) return 0;
+
+	*unwound = 0;
+	while (i--) *unwound += _nvmap_handle_unpin(h[i]);
+	return -ENOMEM;
+}
+
+/* pin a list of handles, mapping IOVMM areas if needed. handles which are
+ * already pinned are pinned without taking nvmap_pin_lock; the remainder
+ * are pinned as a single all-or-nothing operation inside the mutex. if
+ * insufficient IOVMM space is available and wait is set, the mutex is
+ * dropped and the whole operation retried after another task unpins, so
+ * that a blocked client doesn't stall pins from every other client. no
+ * validation is performed on the handles that are provided. */
+static int _nvmap_handle_pin_array(unsigned int nr,
+	struct nvmap_handle **h, bool wait)
+{
+	unsigned int i, nested;
+	int ret, seq, unwound = 0;
+
+	for (nested=0; nested<nr; nested++)
+		if (!_nvmap_handle_pin_nested(h[nested]))
+			break;
+
+	for (ret=0; nested<nr; ) {
+		seq = atomic_read(&nvmap_pin_seq);
+		mutex_lock(&nvmap_pin_lock);
+		ret = _nvmap_handle_pin_array_locked(nr - nested,
+			&h[nested], &unwound);
+		mutex_unlock(&nvmap_pin_lock);
+		/* the unwind made areas reclaimable, as any other unpin */
+		if (ret && unwound) wake_up(&nvmap_pin_wait);
+		if (!ret || !wait) break;
+
+		/* the failed attempt's own unpins don't count as progress */
+		if (wait_event_interruptible(nvmap_pin_wait,
+		    atomic_read(&nvmap_pin_seq) != seq + unwound)) {
+			ret = -EINTR;
+			break;
+		}
 	}
-	mutex_unlock(&nvmap_pin_lock);
 
 	if (ret) {
 		int do_wake = 0;
-		while (i--) do_wake |= _nvmap_handle_unpin(h[i]);
+		while (nested--) do_wake |= _nvmap_handle_unpin(h[nested]);
 		if (do_wake) wake_up(&nvmap_pin_wait);
-		return -EINTR;
-	} else {
-		for (i=0; i<nr; i++)
-			if (h[i]->heap_pgalloc && h[i]->pgalloc.dirty)
-				_nvmap_handle_iovmm_map(h[i]);
+		return ret;
 	}
 
+	for (i=0; i<nr; i++)
+		if (h[i]->heap_pgalloc && h[i]->pgalloc.dirty)
+			_nvmap_handle_iovmm_map(h[i]);
+
 	return 0;
 }
 
+/* pin a list of handles, mapping IOVMM areas if needed. may sleep, if
+ * a handle's IOVMM area has been reclaimed and insufficient IOVMM space
+ * is available to complete the list pin. no validation is performed on
+ * the handles that are provided. */
+static int _nvmap_handle_pin_fast(unsigned int nr, struct nvmap_handle **h)
+{
+	if ( !(h && *h && ((*h)->alloc)) ) {
+		pr_err("%s invalid handle, returning -EINVAL\n",__func__);
+		return -EINVAL;
+	}
+
+	return _nvmap_handle_pin_array(nr, h, true);
+}
+
 static int _nvmap_do_global_unpin(unsigned long ref)
 {
 	struct nvmap_handle *h;
@@ -1835,32 +2270,17 @@ static int _nvmap_do_pin(struct nvmap_file_priv *priv,
 
 	if (ret) return ret;
 
-	mutex_lock(&nvmap_pin_lock);
-	for (i=0; i<nr && !ret; i++) {
-		ret = wait_event_interruptible(nvmap_pin_wait,
-			!_nvmap_handle_pin_locked(h[i]));
-	}
-	mutex_unlock(&nvmap_pin_lock);
-
+	ret = _nvmap_handle_pin_array(nr, h, true);
 	if (ret) {
-		int do_wake = 0;
 		spin_lock(&priv->ref_lock);
-		while (i--) {
+		for (i=0; i<nr; i++) {
 			r = _nvmap_ref_lookup_locked(priv, refs[i]);
-			do_wake |= _nvmap_handle_unpin(r->h);
 			if (r) atomic_dec(&r->pin);
 		}
 		spin_unlock(&priv->ref_lock);
-		if (do_wake) wake_up(&nvmap_pin_wait);
-		return -EINTR;
-	} else {
-		for (i=0; i<nr; i++) {
-			if (h[i]->heap_pgalloc && h[i]->pgalloc.dirty)
-				_nvmap_handle_iovmm_map(h[i]);
-		}
 	}
 
-	return 0;
+	return ret;
 }
 
 static int nvmap_ioctl_pinop(struct file *filp,
@@ -2401,7 +2821,7 @@ static bool _nvmap_carveout_do_compact(struct nvmap_handle *h,
 			spin_lock(&co->lock);
 			idx = co->block_index;
 			while (idx!=-1 && nrelocate <= NVMAP_NRELOCATE_LIMIT) {
-				if (BLOCK(co, co->free_index)->size >= h->size) {
+				if (nvmap_largest_free(co) >= h->size) {
 					compaction_success = true;
 					if (compact_minimal) {
 						break;
@@ -2547,7 +2967,7 @@ retry:
 		}
 	}
 
-	if (free_space < h->size)
+	if (free_space < h->size || !nvmap_carveout_compaction)
 		goto no_space;
 
 	/* try fast compaction first */
@@ -3072,10 +3492,6 @@ static int nvmap_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
-extern void v7_flush_kern_cache_all(void *);
-extern void v7_clean_kern_cache_all(void *);
-#define FLUSH_CLEAN_BY_SET_WAY_THRESHOLD (3 * PAGE_SIZE)
-
 /* perform cache maintenance on a handle; caller's handle must be pre-
  * validated. */
 static int _nvmap_do_cache_maint(struct nvmap_handle *h,
@@ -3466,6 +3882,69 @@ static struct device *__nvmap_heap_parent_dev(void)
 	return misc_nvmap_dev.this_device;
 }
 
+#define NVMAP_POOL_ATTR_RO(_name, _field)				\
+static ssize_t _nvmap_sysfs_show_pool_##_name(struct device *d,		\
+	struct device_attribute *attr, char *buf)			\
+{									\
+	return sprintf(buf, "%u %u %u\n",				\
+		nvmap_pools[NVMAP_POOL_UC]._field,			\
+		nvmap_pools[NVMAP_POOL_WC]._field,			\
+		nvmap_pools[NVMAP_POOL_CACHED]._field);			\
+}									\
+static struct device_attribute nvmap_pool_attr_##_name =		\
+	__ATTR(_name, S_IRUGO, _nvmap_sysfs_show_pool_##_name, NULL)
+
+/* uncached, write-combined and cached pools */
+NVMAP_POOL_ATTR_RO(pool_pages, npages);
+NVMAP_POOL_ATTR_RO(pool_hits, hits);
+NVMAP_POOL_ATTR_RO(pool_misses, misses);
+
+/* number of page allocations, average and maximum latency in usecs */
+static ssize_t _nvmap_sysfs_show_alloc_latency(struct device *d,
+	struct device_attribute *attr, char *buf)
+{
+	unsigned int count, max;
+	u64 avg;
+
+	spin_lock(&nvmap_alloc_stat_lock);
+	count = nvmap_alloc_count;
+	avg = nvmap_alloc_total_us;
+	max = nvmap_alloc_max_us;
+	spin_unlock(&nvmap_alloc_stat_lock);
+
+	if (count)
+		do_div(avg, count);
+	return sprintf(buf, "%u %llu %u\n", count, avg, max);
+}
+
+static struct device_attribute nvmap_alloc_latency_attr =
+	__ATTR(alloc_latency, S_IRUGO, _nvmap_sysfs_show_alloc_latency, NULL);
+
+/* pins which found the handle's IOVMM mapping intact, pins which needed
+ * the handle to be mapped again, and areas reclaimed from unpinned handles */
+static ssize_t _nvmap_sysfs_show_iovmm_cache(struct device *d,
+	struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u %u %u\n", nvmap_iovmm_cache_hits,
+		nvmap_iovmm_cache_misses, nvmap_iovmm_cache_evictions);
+}
+
+static struct device_attribute nvmap_iovmm_cache_attr =
+	__ATTR(iovmm_cache, S_IRUGO, _nvmap_sysfs_show_iovmm_cache, NULL);
+
+static struct attribute *nvmap_pool_attrs[] = {
+	&nvmap_pool_attr_pool_pages.attr,
+	&nvmap_pool_attr_pool_hits.attr,
+	&nvmap_pool_attr_pool_misses.attr,
+	&nvmap_alloc_latency_attr.attr,
+	&nvmap_iovmm_cache_attr.attr,
+	NULL,
+};
+
+static struct attribute_group nvmap_pool_attr_group = {
+	.attrs = nvmap_pool_attrs,
+};
+
 /* creates the sysfs attribute files for a carveout heap; if called
  * before fs initialization, silently returns.
  */
@@ -3505,6 +3984,10 @@ static int __init nvmap_dev_init(void)
 	if (misc_register(&misc_nvmap_dev))
 		pr_err("%s error registering %s\n", __func__,
 			misc_nvmap_dev.name);
+	else if (sysfs_create_group(&misc_nvmap_dev.this_device->kobj,
+			&nvmap_pool_attr_group))
+		pr_err("%s: failed to create page pool attributes\n",
+			__func__);
 
 	if (misc_register(&misc_knvmap_dev))
 		pr_err("%s error registering %s\n", __func__,
@@ -3559,6 +4042,7 @@ static int __init nvmap_core_init(void)
 	nvmap_context.init_data.su = true;
 	nvmap_context.init_data.iovm_limit = 0;
 	INIT_LIST_HEAD(&nvmap_context.heaps);
+	nvmap_pool_init();
 
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
 	for (i=0; i<ARRAY_SIZE(nvmap_mru_cutoff); i++)
@@ -4390,9 +4874,10 @@ int nvmap_pin_array(struct file *filp,
 	void *pteaddr = NULL;
 	int ret = 0;
 
+	/* the visited flags are protected by the pin mutex */
 	mutex_lock(&nvmap_pin_lock);
 
-	/* find unique handles, pin them and collect into unpin array */
+	/* find unique handles and collect them into the unpin array */
 	for (elem = arr, i = num_elems; i && !ret; i--, elem++) {
 		struct nvmap_handle *to_pin = elem->pin_mem;
 		if (to_pin->poison != NVDA_POISON) {
@@ -4412,17 +4897,8 @@ int nvmap_pin_array(struct file *filp,
 					break;
 				}
 			}
-			if (wait) {
-				ret = wait_event_interruptible(
-					nvmap_pin_wait,
-					!_nvmap_handle_pin_locked(to_pin));
-			}
-			else
-				ret = _nvmap_handle_pin_locked(to_pin);
-			if (!ret) {
-				to_pin->flags |= NVMEM_HANDLE_VISITED;
-				unique_arr[unique_idx++] = to_pin;
-			}
+			to_pin->flags |= NVMEM_HANDLE_VISITED;
+			unique_arr[unique_idx++] = to_pin;
 		}
 	}
 
@@ -4433,9 +4909,15 @@ int nvmap_pin_array(struct file *filp,
 
 	mutex_unlock(&nvmap_pin_lock);
 
-	if (!ret)
-		ret = nvmap_map_pte(pfn, pgprot_kernel, &pteaddr);
+	if (ret)
+		return ret;
+
+	/* pin the unique handles as one batch */
+	ret = _nvmap_handle_pin_array(unique_idx, unique_arr, wait);
+	if (ret)
+		return ret;
 
+	ret = nvmap_map_pte(pfn, pgprot_kernel, &pteaddr);
 	if (unlikely(ret)) {
 		int do_wake = 0;
 		i = unique_idx;
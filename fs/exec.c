@@ -923,6 +923,7 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+		task_oom_adj_notify(tsk);
 	}
 
 	sig->group_exit_task = NULL;
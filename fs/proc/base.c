@@ -1143,6 +1143,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		task_oom_adj_notify(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1278,6 +1280,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		task_oom_adj_notify(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -18,6 +18,7 @@
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/list.h>
+#include <linux/types.h>
 #endif
 
 /* The early_suspend structure defines suspend and resume hooks to be called
@@ -29,6 +30,10 @@
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
+ * When the async_handlers parameter is set, handlers registered at the same
+ * level are called concurrently with each other, but a level is only started
+ * after all handlers of the previous level have returned. It is off by
+ * default, as existing handlers may depend on the order within a level.
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
@@ -41,6 +46,14 @@ struct early_suspend {
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	/* maintained by the early suspend core, times in microseconds */
+	struct {
+		bool		running;
+		u32		suspend_time;
+		u32		resume_time;
+		u32		max_suspend_time;
+		u32		max_resume_time;
+	} stat;
 #endif
 };
 
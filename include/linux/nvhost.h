@@ -70,6 +70,19 @@ struct nvhost_set_nvmap_fd_args {
 	__u32 fd;
 };
 
+/* jobs points to size bytes holding num_jobs jobs, each laid out as for
+ * write(): a struct nvhost_submit_hdr followed by its nvhost_cmdbuf,
+ * nvhost_reloc and nvhost_waitchk arrays. the syncpoint value at which
+ * each submitted job completes is returned in fences. if a job fails
+ * after earlier ones were submitted, the ioctl succeeds and num_jobs is
+ * set to the number submitted; resubmitting the rest reports the error */
+struct nvhost_submit_args {
+	__u32 num_jobs;
+	__u32 size;
+	const void *jobs;
+	__u32 *fences;
+};
+
 #define NVHOST_IOCTL_CHANNEL_FLUSH		\
 	_IOR(NVHOST_IOCTL_MAGIC, 1, struct nvhost_get_param_args)
 #define NVHOST_IOCTL_CHANNEL_GET_SYNCPOINTS	\
@@ -82,9 +95,11 @@ struct nvhost_set_nvmap_fd_args {
 	_IOW(NVHOST_IOCTL_MAGIC, 5, struct nvhost_set_nvmap_fd_args)
 #define NVHOST_IOCTL_CHANNEL_GET_STATS		\
 	_IOR(NVHOST_IOCTL_MAGIC, 6, struct nvhost_get_param_args)
+#define NVHOST_IOCTL_CHANNEL_SUBMIT		\
+	_IOWR(NVHOST_IOCTL_MAGIC, 7, struct nvhost_submit_args)
 #define NVHOST_IOCTL_CHANNEL_LAST		\
-	_IOC_NR(NVHOST_IOCTL_CHANNEL_GET_STATS)
-#define NVHOST_IOCTL_CHANNEL_MAX_ARG_SIZE sizeof(struct nvhost_get_param_args)
+	_IOC_NR(NVHOST_IOCTL_CHANNEL_SUBMIT)
+#define NVHOST_IOCTL_CHANNEL_MAX_ARG_SIZE sizeof(struct nvhost_submit_args)
 
 struct nvhost_ctrl_syncpt_read_args {
 	__u32 id;
@@ -115,6 +130,25 @@ struct nvhost_ctrl_module_regrdwr_args {
 	__u32 write;
 };
 
+struct nvhost_ctrl_fence_pt {
+	__u32 id;
+	__u32 thresh;
+};
+
+/* a fence signals once every one of its sync points has reached its
+ * threshold; it is returned as a pollable file descriptor */
+struct nvhost_ctrl_fence_create_args {
+	__u32 num_pts;
+	struct nvhost_ctrl_fence_pt *pts;
+	__s32 fd;	/* out */
+};
+
+struct nvhost_ctrl_fence_merge_args {
+	__s32 fd1;
+	__s32 fd2;
+	__s32 fd;	/* out */
+};
+
 #define NVHOST_IOCTL_CTRL_SYNCPT_READ		\
 	_IOWR(NVHOST_IOCTL_MAGIC, 1, struct nvhost_ctrl_syncpt_read_args)
 #define NVHOST_IOCTL_CTRL_SYNCPT_INCR		\
@@ -127,8 +161,13 @@ struct nvhost_ctrl_module_regrdwr_args {
 #define NVHOST_IOCTL_CTRL_MODULE_REGRDWR	\
 	_IOWR(NVHOST_IOCTL_MAGIC, 5, struct nvhost_ctrl_module_regrdwr_args)
 
+#define NVHOST_IOCTL_CTRL_FENCE_CREATE		\
+	_IOWR(NVHOST_IOCTL_MAGIC, 6, struct nvhost_ctrl_fence_create_args)
+#define NVHOST_IOCTL_CTRL_FENCE_MERGE		\
+	_IOWR(NVHOST_IOCTL_MAGIC, 7, struct nvhost_ctrl_fence_merge_args)
+
 #define NVHOST_IOCTL_CTRL_LAST			\
-	_IOC_NR(NVHOST_IOCTL_CTRL_MODULE_REGRDWR)
+	_IOC_NR(NVHOST_IOCTL_CTRL_FENCE_MERGE)
 #define NVHOST_IOCTL_CTRL_MAX_ARG_SIZE sizeof(struct nvhost_ctrl_module_regrdwr_args)
 
 #endif
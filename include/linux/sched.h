@@ -1308,6 +1308,10 @@ struct task_struct {
 	/* PID/PID hash table linkage. */
 	struct pid_link pids[PIDTYPE_MAX];
 	struct list_head thread_group;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* lowmemorykiller victim index, keyed by signal->oom_adj */
+	struct list_head lmk_node;
+#endif
 
 	struct completion *vfork_done;		/* for vfork() */
 	int __user *set_child_tid;		/* CLONE_CHILD_SETTID */
@@ -1726,6 +1730,9 @@ extern void thread_group_times(struct task_struct *p, cputime_t *ut, cputime_t *
 
 extern int task_free_register(struct notifier_block *n);
 extern int task_free_unregister(struct notifier_block *n);
+extern int task_oom_adj_register(struct notifier_block *n);
+extern int task_oom_adj_unregister(struct notifier_block *n);
+extern void task_oom_adj_notify(struct task_struct *tsk);
 
 /*
  * Per process flags
@@ -0,0 +1,57 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tegra_hotplug
+
+#if !defined(_TRACE_TEGRA_HOTPLUG_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_TEGRA_HOTPLUG_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(tegra_hotplug_sample,
+
+	TP_PROTO(unsigned int online, unsigned int avg_nr, unsigned int load),
+
+	TP_ARGS(online, avg_nr, load),
+
+	TP_STRUCT__entry(
+		__field(	unsigned int,	online	)
+		__field(	unsigned int,	avg_nr	)
+		__field(	unsigned int,	load	)
+	),
+
+	TP_fast_assign(
+		__entry->online = online;
+		__entry->avg_nr = avg_nr;
+		__entry->load = load;
+	),
+
+	TP_printk("online=%u avg_nr=%u.%02u load=%u",
+		  __entry->online, __entry->avg_nr / 100,
+		  __entry->avg_nr % 100, __entry->load)
+);
+
+TRACE_EVENT(tegra_hotplug_decision,
+
+	TP_PROTO(unsigned int cpu, bool up, int ret),
+
+	TP_ARGS(cpu, up, ret),
+
+	TP_STRUCT__entry(
+		__field(	unsigned int,	cpu	)
+		__field(	bool,		up	)
+		__field(	int,		ret	)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->up = up;
+		__entry->ret = ret;
+	),
+
+	TP_printk("cpu=%u %s ret=%d", __entry->cpu,
+		  __entry->up ? "up" : "down", __entry->ret)
+);
+
+#endif /* _TRACE_TEGRA_HOTPLUG_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
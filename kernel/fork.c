@@ -157,6 +157,7 @@ static struct kmem_cache *mm_cachep;
 
 /* Notifier list called when a task struct is freed */
 static ATOMIC_NOTIFIER_HEAD(task_free_notifier);
+static ATOMIC_NOTIFIER_HEAD(task_oom_adj_notifier);
 
 static void account_kernel_stack(struct thread_info *ti, int account)
 {
@@ -201,6 +202,28 @@ int task_free_unregister(struct notifier_block *n)
 }
 EXPORT_SYMBOL(task_free_unregister);
 
+int task_oom_adj_register(struct notifier_block *n)
+{
+	return atomic_notifier_chain_register(&task_oom_adj_notifier, n);
+}
+EXPORT_SYMBOL(task_oom_adj_register);
+
+int task_oom_adj_unregister(struct notifier_block *n)
+{
+	return atomic_notifier_chain_unregister(&task_oom_adj_notifier, n);
+}
+EXPORT_SYMBOL(task_oom_adj_unregister);
+
+/*
+ * Called when a new process appears or its oom_adj/oom_score_adj is
+ * changed, so that interested parties can keep their own index of
+ * processes by badness.  Must be called without task_lock held.
+ */
+void task_oom_adj_notify(struct task_struct *tsk)
+{
+	atomic_notifier_call_chain(&task_oom_adj_notifier, 0, tsk);
+}
+
 void __put_task_struct(struct task_struct *tsk)
 {
 	WARN_ON(!tsk->exit_state);
@@ -1260,6 +1283,9 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	 */
 	p->group_leader = p;
 	INIT_LIST_HEAD(&p->thread_group);
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	INIT_LIST_HEAD(&p->lmk_node);
+#endif
 
 	/* Now that the task is set up, run cgroup callbacks if
 	 * necessary. We need to run them before the task is visible
@@ -1327,6 +1353,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	total_forks++;
 	spin_unlock(&current->sighand->siglock);
 	write_unlock_irq(&tasklist_lock);
+	if (!(clone_flags & CLONE_THREAD))
+		task_oom_adj_notify(p);
 	proc_fork_connector(p);
 	cgroup_post_fork(p);
 	perf_event_fork(p);
@@ -13,10 +13,14 @@
  *
  */
 
+#include <linux/async.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/timer.h>
 #include <linux/wakelock.h>
@@ -46,8 +50,15 @@ static int late_resume_queue_timeout = 10;
 module_param_named(late_resume_queue_timeout, late_resume_queue_timeout,
 			int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+static int async_handlers;
+module_param_named(async_handlers, async_handlers,
+			int, S_IRUGO | S_IWUSR | S_IWGRP);
+
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
+static LIST_HEAD(early_suspend_domain);
+static ktime_t early_suspend_time;
+static ktime_t late_resume_time;
 static void early_suspend(struct work_struct *work);
 static void late_resume(struct work_struct *work);
 static void early_suspend_wd_enable(int suspend_type, void (*data), int timeout);
@@ -132,9 +143,110 @@ void unregister_early_suspend(struct early_suspend *handler)
 }
 EXPORT_SYMBOL(unregister_early_suspend);
 
-static void early_suspend(struct work_struct *work)
+static void call_handler(void *data, async_cookie_t cookie, int suspend_type)
 {
+	struct early_suspend *h = data;
+	ktime_t start = ktime_get();
+	u32 us;
+
+	h->stat.running = true;
+	if (suspend_type == EARLY_SUSPEND)
+		h->suspend(h);
+	else
+		h->resume(h);
+	h->stat.running = false;
+
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+	if (suspend_type == EARLY_SUSPEND) {
+		h->stat.suspend_time = us;
+		if (us > h->stat.max_suspend_time)
+			h->stat.max_suspend_time = us;
+	} else {
+		h->stat.resume_time = us;
+		if (us > h->stat.max_resume_time)
+			h->stat.max_resume_time = us;
+	}
+}
+
+static void call_suspend_handler(void *data, async_cookie_t cookie)
+{
+	call_handler(data, cookie, EARLY_SUSPEND);
+}
+
+static void call_resume_handler(void *data, async_cookie_t cookie)
+{
+	call_handler(data, cookie, LATE_RESUME);
+}
+
+/*
+ * Suspend handlers are called by ascending level and resume handlers by
+ * descending level.  With async_handlers set, all handlers of one level are
+ * started on the async domain and waited for before the next level is
+ * started, so a level only takes as long as its slowest handler, and the
+ * watchdog covers the whole level.  Otherwise handlers are called one at a
+ * time, each under its own watchdog.  Must be called with
+ * early_suspend_lock held.
+ */
+static void call_handlers(int suspend_type)
+{
+	struct list_head *node;
 	struct early_suspend *pos;
+	void (*func)(struct early_suspend *h);
+	int timeout;
+	int level = 0;
+	bool pending = false;
+	bool async = async_handlers;	/* the parameter may change under us */
+	ktime_t start = ktime_get();
+
+	if (suspend_type == EARLY_SUSPEND) {
+		node = early_suspend_handlers.next;
+		timeout = early_suspend_timeout_value;
+	} else {
+		node = early_suspend_handlers.prev;
+		timeout = late_resume_timeout_value;
+	}
+
+	while (node != &early_suspend_handlers) {
+		pos = list_entry(node, struct early_suspend, link);
+		node = suspend_type == EARLY_SUSPEND ? node->next : node->prev;
+
+		func = suspend_type == EARLY_SUSPEND ? pos->suspend : pos->resume;
+		if (func == NULL)
+			continue;
+		if (!async) {
+			early_suspend_wd_enable(suspend_type, func, timeout);
+			call_handler(pos, 0, suspend_type);
+			early_suspend_wd_disable(suspend_type);
+			continue;
+		}
+		if (pending && pos->level != level) {
+			async_synchronize_full_domain(&early_suspend_domain);
+			early_suspend_wd_disable(suspend_type);
+			pending = false;
+		}
+		if (!pending) {
+			early_suspend_wd_enable(suspend_type, func, timeout);
+			level = pos->level;
+			pending = true;
+		}
+		async_schedule_domain(suspend_type == EARLY_SUSPEND ?
+				      call_suspend_handler :
+				      call_resume_handler,
+				      pos, &early_suspend_domain);
+	}
+	if (pending) {
+		async_synchronize_full_domain(&early_suspend_domain);
+		early_suspend_wd_disable(suspend_type);
+	}
+
+	if (suspend_type == EARLY_SUSPEND)
+		early_suspend_time = ktime_sub(ktime_get(), start);
+	else
+		late_resume_time = ktime_sub(ktime_get(), start);
+}
+
+static void early_suspend(struct work_struct *work)
+{
 	unsigned long irqflags;
 	int abort = 0;
 
@@ -158,14 +270,7 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL) {
-			early_suspend_wd_enable(EARLY_SUSPEND, pos->suspend,
-				early_suspend_timeout_value);
-			pos->suspend(pos);
-			early_suspend_wd_disable(EARLY_SUSPEND);
-			}
-	}
+	call_handlers(EARLY_SUSPEND);
 	mutex_unlock(&early_suspend_lock);
 
 abort:
@@ -177,7 +282,6 @@ abort:
 
 static void late_resume(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
 
@@ -197,13 +301,7 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL) {
-			early_suspend_wd_enable(LATE_RESUME, pos->resume,
-				late_resume_timeout_value);
-			pos->resume(pos);
-			early_suspend_wd_disable(LATE_RESUME);
-			}
+	call_handlers(LATE_RESUME);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -251,6 +349,18 @@ suspend_state_t get_suspend_state(void)
 	return requested_suspend_state;
 }
 
+/* Called from the watchdogs while early_suspend_lock is held by the worker */
+static void print_running_handlers(void)
+{
+	struct early_suspend *pos;
+
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		if (pos->stat.running)
+			printk(KERN_EMERG "**** still running: level %d,"
+				" suspend %pF, resume %pF\n", pos->level,
+				pos->suspend, pos->resume);
+}
+
 static void early_suspend_timeout(unsigned long data)
 {
 	if (data == (unsigned long)early_suspend)
@@ -258,10 +368,12 @@ static void early_suspend_timeout(unsigned long data)
 			"waiting for early suspend work to start; "
 			"state: %d, requested state: %d.\n", state,
 			requested_suspend_state);
-	else
+	else {
 		printk(KERN_EMERG "**** Early Suspend Timeout; function:"
 			" %pF, state: %d, requested state: %d.\n",
 			(void *)data, state, requested_suspend_state);
+		print_running_handlers();
+	}
 
 	dump_process_state(s_nvrm_daemon_pid);
 	dump_process_state(suspend_pid);
@@ -276,10 +388,12 @@ static void late_resume_timeout(unsigned long data)
 			"waiting for late resume work to start; "
 			"state: %d, requested state: %d.\n", state,
 			requested_suspend_state);
-	else
+	else {
 		printk(KERN_EMERG "**** Late Resume Timeout; function:"
 			" %pF, state: %d, requested state: %d.\n",
 			(void *)data, state, requested_suspend_state);
+		print_running_handlers();
+	}
 
 	dump_process_state(s_nvrm_daemon_pid);
 	dump_process_state(suspend_pid);
@@ -348,3 +462,43 @@ static void early_suspend_wd_disable(int suspend_type)
                         pr_info("Late Resume watchdog stopped.\n");
 	}
 }
+
+static int early_suspend_stats_show(struct seq_file *m, void *unused)
+{
+	struct early_suspend *pos;
+
+	mutex_lock(&early_suspend_lock);
+	seq_printf(m, "last early suspend %lldus, last late resume %lldus\n",
+		   ktime_to_us(early_suspend_time),
+		   ktime_to_us(late_resume_time));
+	seq_puts(m, "level\tsuspend\tmax_suspend\tresume\tmax_resume"
+		 "\thandler\n");
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		seq_printf(m, "%d\t%u\t%u\t%u\t%u\t%pF\n", pos->level,
+			   pos->stat.suspend_time, pos->stat.max_suspend_time,
+			   pos->stat.resume_time, pos->stat.max_resume_time,
+			   pos->suspend ? (void *)pos->suspend :
+					  (void *)pos->resume);
+	mutex_unlock(&early_suspend_lock);
+	return 0;
+}
+
+static int early_suspend_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_stats_show, NULL);
+}
+
+static const struct file_operations early_suspend_stats_fops = {
+	.open = early_suspend_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init early_suspend_debugfs_init(void)
+{
+	debugfs_create_file("early_suspend_stats", S_IRUGO, NULL, NULL,
+			    &early_suspend_stats_fops);
+	return 0;
+}
+late_initcall(early_suspend_debugfs_init);